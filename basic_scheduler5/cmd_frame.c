@@ -0,0 +1,73 @@
+#include "cmd_frame.h"
+#include "slip.h"
+
+void cmd_frame_reset(struct CmdFrameParser* parser) {
+	parser->pos = 0;
+}
+
+bool cmd_frame_in_progress(const struct CmdFrameParser* parser) {
+	return parser->pos > 0;
+}
+
+enum CmdFrameResult cmd_frame_push(struct CmdFrameParser* parser, uint8_t data) {
+	uint8_t pos = parser->pos++;
+	if (pos == 0) {
+		// A frame needs at least the sequence number and type.
+		if (data < 2 || data > CMD_FRAME_MAX_BODY) {
+			cmd_frame_reset(parser);
+			return CMD_FRAME_ERROR;
+		}
+		parser->len = data;
+		parser->crc = 0xFFFF;
+	} else if (pos <= parser->len) {
+		parser->body[pos - 1] = data;
+	} else if (pos == parser->len + 1) {
+		// Compare the low byte now and the high byte once it arrives.
+		if (data != (parser->crc & 0xFF)) {
+			cmd_frame_reset(parser);
+			return CMD_FRAME_ERROR;
+		}
+		return CMD_FRAME_INCOMPLETE;
+	} else {
+		bool valid = data == (parser->crc >> 8);
+		cmd_frame_reset(parser);
+		return valid ? CMD_FRAME_READY : CMD_FRAME_ERROR;
+	}
+	parser->crc = cmd_frame_crc_update(parser->crc, data);
+	return CMD_FRAME_INCOMPLETE;
+}
+
+static void write_escaped(struct CmdFrameWriter* writer, uint8_t data) {
+	writer->crc = cmd_frame_crc_update(writer->crc, data);
+	if (data == SLIP_END) {
+		writer->write_byte(SLIP_ESC);
+		writer->write_byte(SLIP_ESC_END);
+	} else if (data == SLIP_ESC) {
+		writer->write_byte(SLIP_ESC);
+		writer->write_byte(SLIP_ESC_ESC);
+	} else {
+		writer->write_byte(data);
+	}
+}
+
+void cmd_frame_begin(struct CmdFrameWriter* writer, uint8_t payload_len, uint8_t seq, uint8_t type) {
+	writer->crc = 0xFFFF;
+	writer->write_byte(SLIP_END);
+	write_escaped(writer, payload_len + 2);
+	write_escaped(writer, seq);
+	write_escaped(writer, type);
+}
+
+void cmd_frame_write(struct CmdFrameWriter* writer, const void* data, uint8_t len) {
+	for (uint8_t i = 0; i < len; i++) {
+		write_escaped(writer, ((const uint8_t*)data)[i]);
+	}
+}
+
+void cmd_frame_end(struct CmdFrameWriter* writer) {
+	// Save the CRC since writing it updates writer->crc.
+	uint16_t crc = writer->crc;
+	write_escaped(writer, crc & 0xFF);
+	write_escaped(writer, crc >> 8);
+	writer->write_byte(SLIP_END);
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Framing for the commands between the host and the kernel.
+// Each frame is: length, sequence number, type, payload..., CRC16 low byte, CRC16 high byte.
+// The length counts the sequence number, type and payload. The CRC is CRC-16/CCITT (polynomial 0x1021,
+// starting from 0xFFFF) over everything before it.
+// For commands the type is the command, and for responses it's one of the CmdStatus values.
+// This doesn't depend on the AVR so it can be compiled and tested on the host.
+
+// The largest sequence number + type + payload accepted by the parser.
+#define CMD_FRAME_MAX_BODY 32
+
+enum CmdStatus {
+	// The command was run. The payload depends on the command.
+	CMD_STATUS_ACK = 0,
+	// The frame was corrupted. The host should resend it. Also sent when CMD_WRITE is given up on because a page was
+	// corrupted or stopped arriving.
+	CMD_STATUS_NAK = 1,
+	// The frame was valid but the command couldn't be run. Resending won't help.
+	CMD_STATUS_ERROR = 2,
+	// Sent during CMD_WRITE to request the next page. The payload is the flash offset.
+	CMD_STATUS_PAGE = 3,
+	// Sent without a command when a task is stopped for a fault. The sequence number is 0 and the payload is the
+	// task index and the TaskFault.
+	CMD_STATUS_FAULT = 4
+};
+
+enum CmdFrameResult {
+	CMD_FRAME_INCOMPLETE,
+	// A full frame was received. The body is in the parser's buffer.
+	CMD_FRAME_READY,
+	// The frame had a bad length or CRC. The parser is reset to look for the next frame.
+	CMD_FRAME_ERROR
+};
+
+struct CmdFrameParser {
+	// The number of bytes of the frame received so far.
+	uint8_t pos;
+	// The length of the body.
+	uint8_t len;
+	// After CMD_FRAME_READY, this is the CRC of the frame.
+	uint16_t crc;
+	uint8_t body[CMD_FRAME_MAX_BODY];
+};
+
+struct CmdFrameWriter {
+	uint16_t crc;
+	void (*write_byte)(uint8_t);
+};
+
+// This is inlined since HandleWriteCmd calls it for every byte it receives.
+static inline __attribute__((always_inline)) uint16_t cmd_frame_crc_update(uint16_t crc, uint8_t data) {
+	crc ^= (uint16_t)data << 8;
+	for (uint8_t i = 0; i < 8; i++) {
+		if (crc & 0x8000) {
+			crc = (crc << 1) ^ 0x1021;
+		} else {
+			crc <<= 1;
+		}
+	}
+	return crc;
+}
+
+// Drop any partially received frame.
+void cmd_frame_reset(struct CmdFrameParser* parser);
+
+// Returns true if the parser is part way through a frame.
+bool cmd_frame_in_progress(const struct CmdFrameParser* parser);
+
+// Add a received byte to the frame.
+// After CMD_FRAME_READY, the body is in parser->body and the next byte starts a new frame.
+enum CmdFrameResult cmd_frame_push(struct CmdFrameParser* parser, uint8_t data);
+
+// Write a frame by calling cmd_frame_begin, then cmd_frame_write for the payload, then cmd_frame_end.
+// payload_len is the total that will be passed to cmd_frame_write and must be at most 253.
+// The bytes are SLIP encoded so the host can find the frames in the output from the tasks.
+void cmd_frame_begin(struct CmdFrameWriter* writer, uint8_t payload_len, uint8_t seq, uint8_t type);
+void cmd_frame_write(struct CmdFrameWriter* writer, const void* data, uint8_t len);
+void cmd_frame_end(struct CmdFrameWriter* writer);
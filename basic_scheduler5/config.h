@@ -0,0 +1,115 @@
+#pragma once
+
+// Build options for the scheduler. This is also included by helpers.s and the tasks (through
+// scheduler_funcs.h), so it can only contain preprocessor definitions.
+
+// The number of task slots including the "kernel" task.
+#ifndef MAX_TASKS
+	#define MAX_TASKS 5
+#endif
+// The number of loadable tasks.
+#define MAX_LD_TASKS (MAX_TASKS - 1)
+
+// The size of a task's stack in bytes if the loader doesn't ask for a different size.
+// A task suspended by a syscall uses 20 bytes of this to store its context, and a preempted task uses 37.
+// Tasks can ask for less, down to MIN_STACK_SIZE below.
+#ifndef STACK_SIZE
+	#define STACK_SIZE 64
+#endif
+// Define STACK_GUARD to put a guard word at the bottom of each task's stack that's checked every time the task
+// switches back to the kernel. A task that overflows its stack is disabled and reported to the host. The check
+// adds about 16 cycles to each round trip to a task, which takes about 200 cycles without it.
+#define STACK_GUARD
+
+// The RAM shared by the stacks of the enabled tasks. A task's stack is allocated from this when it's enabled.
+// This is also used to buffer flash pages while writing tasks, so it must be at least 256 bytes.
+#ifndef STACK_ARENA_SIZE
+	#define STACK_ARENA_SIZE (MAX_LD_TASKS * STACK_SIZE)
+#endif
+
+// Define LEAN_KERNEL_SWITCH to have start_task and suspend_task only save the kernel's frame pointer instead of all
+// of its call-saved registers. The compiler saves the registers the main loop actually needs around the switch
+// instead. This saves up to 64 cycles on each round trip to a task and 16 bytes of the kernel stack. The task side
+// of the switch is the same either way, so it doesn't make the task stacks any smaller. A task is suspended in the
+// middle of its own code, so all 18 of its call-saved registers have to be kept.
+#define LEAN_KERNEL_SWITCH
+
+// The number of task priority levels. Higher values run first.
+#ifndef NUM_PRIORITIES
+	#define NUM_PRIORITIES 4
+#endif
+
+// The number of mutexes tasks can use through the scheduler's lock functions.
+#ifndef NUM_LOCKS
+	#define NUM_LOCKS 4
+#endif
+
+// The amount of flash set aside for loading tasks.
+#define TASK_PRGM_MEM_SIZE 2048
+
+// The RAM shared by the tasks for their .data and .bss. Must be at most 255.
+// Keep MAX_TASK_DATA in client.py the same.
+#ifndef TASK_DATA_ARENA_SIZE
+	#define TASK_DATA_ARENA_SIZE 64
+#endif
+
+// Define PREEMPTIVE to have timer0 switch away from tasks that run for longer than PREEMPT_QUANTUM_MS
+// without calling a syscall that suspends them.
+// Tasks are only preempted while executing their own code, never in the middle of a syscall.
+//#define PREEMPTIVE
+#ifndef PREEMPT_QUANTUM_MS
+	// Must be 1-255.
+	#define PREEMPT_QUANTUM_MS 10
+#endif
+
+// Define TASK_STATS to count how long each task runs, how often it's switched to, its longest run, how long it
+// waits on locks, and how many deadlines it misses. The host reads them with CMD_STATS. This uses 16 bytes of RAM
+// per task, and reads the timer twice on each switch.
+#define TASK_STATS
+
+// Define TRACE to record context switches, wake ups, lock operations, and UART interrupts in a ring the host can
+// drain with CMD_TRACE. Each record is 4 bytes of RAM, and TRACE_DEPTH must be a power of 2 up to 32.
+// It's off by default, so client.py trace needs a kernel built with this uncommented, or with make KERNEL_DEFS=-DTRACE.
+//#define TRACE
+#ifndef TRACE_DEPTH
+	#define TRACE_DEPTH 32
+#endif
+
+// The smallest stack a task can ask for. The ISRs run on the stack of the task they interrupt and don't nest, so the
+// worst case the kernel adds to a task's stack is an interrupt taken at the bottom of the deepest syscall:
+// * 2 bytes for the guard word with STACK_GUARD.
+// * About 26 bytes for get_lock, which goes through mutex_lock, update_task_priority and run_queue_set_priority for
+//   the priority inheritance. That's 4 return addresses and the registers the functions save.
+// * Up to 17 bytes for the ISR: its return address, r0, r1, SREG and the 12 call-clobbered registers. With TRACE the
+//   UART ISRs take about 6 more, since they call trace_record.
+// A task suspended in a syscall (20 bytes on top of the syscall's frame) or preempted (37 bytes) uses less than
+// this. The few bytes left over are all a task gets for its own locals, so a task that uses more has to ask for more.
+#ifdef TRACE
+	#define MIN_STACK_SIZE 56
+#else
+	#define MIN_STACK_SIZE 48
+#endif
+
+// Kernel message queues. Each queue holds up to QUEUE_DEPTH messages of exactly QUEUE_MSG_SIZE bytes.
+// The message storage is allocated statically, so this uses NUM_QUEUES * QUEUE_DEPTH * QUEUE_MSG_SIZE bytes of RAM.
+#ifndef NUM_QUEUES
+	#define NUM_QUEUES 2
+#endif
+#ifndef QUEUE_DEPTH
+	#define QUEUE_DEPTH 2
+#endif
+#ifndef QUEUE_MSG_SIZE
+	#define QUEUE_MSG_SIZE 8
+#endif
+
+// The rate of the timer used by get_time.
+#define TICKS_PER_MS 250
+
+// The size of the receive buffer for each task's UART channel. One byte is always left empty, so a read gets at most
+// RX_BUFFER_LEN - 1 bytes, and whatever is sent to the task past that before it reads is dropped.
+#ifndef RX_BUFFER_LEN
+	#define RX_BUFFER_LEN 8
+#endif
+
+// The event bit set while a task has unread UART data. The other event bits are free for the tasks to use.
+#define EVENT_USART_RX 0x01
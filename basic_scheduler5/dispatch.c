@@ -0,0 +1,92 @@
+#include "dispatch.h"
+#include "events.h"
+#include "hal.h"
+#include "run_queue.h"
+#include "serial.h"
+#include "stats.h"
+#include "trace.h"
+
+// Referenced in assembly code.
+struct Task* current_task;
+
+// Used to track which task is active.
+uint8_t task_idx = 0;
+
+// Referenced by the run queue to sort the sleeping tasks.
+struct Task tasks[MAX_LD_TASKS] = {0};
+
+#ifdef PREEMPTIVE
+// The number of timer0 ticks (1ms) left in the current task's time slice. 0 if preemption is disabled.
+// Referenced in assembly code, which sets it to 0 when the task is preempted.
+volatile uint8_t preempt_ticks_left = 0;
+
+// Start the time slice for the task that's about to run.
+static inline void preempt_arm() {
+	preempt_ticks_left = PREEMPT_QUANTUM_MS;
+	TCNT0 = 0;
+	TIFR0 = 1 << OCF0A;
+	TIMSK0 = 1 << OCIE0A;
+}
+
+// Stop the time slice timer. Returns true if the task was preempted instead of suspending itself.
+// The interrupt is disabled while the kernel runs so it doesn't wake the MCU from idle.
+static inline bool preempt_disarm() {
+	TIMSK0 = 0;
+	bool preempted = preempt_ticks_left == 0;
+	preempt_ticks_left = 0;
+	return preempted;
+}
+#endif
+
+#ifdef STACK_GUARD
+// Only the guard word is checked so this is cheap enough to do on every switch. The task's stack may have gone
+// further and come back, but then it's very likely to have changed the guard on the way.
+static inline bool is_stack_guard_intact(struct Task* task) {
+	return *(uint16_t*)task->stack_start == STACK_GUARD_WORD;
+}
+#endif
+
+bool dispatch_next() {
+	// Wake the tasks waiting for UART data.
+	if (USART_Rx_Event()) {
+		post_usart_rx_event();
+	}
+	// Only the tasks at the head of the sleep queue need to be checked to see if they're due.
+	run_queue_wake_due();
+	uint8_t next_idx = run_queue_pop();
+	if (next_idx == NO_TASK) {
+		return false;
+	}
+	task_idx = next_idx;
+	current_task = tasks + task_idx;
+	TRACE_EVENT(TRACE_SWITCH_IN, task_idx);
+#ifdef TASK_STATS
+	uint32_t run_start = get_time();
+#endif
+#ifdef PREEMPTIVE
+	preempt_arm();
+#endif
+	// This switches to the stack for the current_task. Execution won't return here until that
+	// task calls suspend_task (or is preempted).
+	START_TASK();
+	STATS_ADD_RUN(task_idx, get_time() - run_start);
+	bool preempted = false;
+#ifdef PREEMPTIVE
+	preempted = preempt_disarm();
+#endif
+	TRACE_EVENT(preempted ? TRACE_PREEMPT : TRACE_SWITCH_OUT, task_idx);
+	bool overflowed = false;
+#ifdef STACK_GUARD
+	overflowed = !is_stack_guard_intact(current_task);
+#endif
+	if (overflowed) {
+		fault_task(task_idx, TASK_FAULT_STACK);
+	} else if (preempted) {
+		// The task still has work to do, so it goes straight back to being ready.
+		run_queue_ready(task_idx);
+	} else if (current_task->enabled && !run_queue_is_blocked(task_idx)) {
+		// The task set next_run before suspending, so queue it up to be woken at that time.
+		run_queue_sleep(task_idx);
+	}
+	return true;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+#include "syscalls.h"
+
+// The part of the main loop that picks a task and runs it. This is shared by the AVR kernel in main.c and the
+// host simulation in host/.
+
+extern struct Task tasks[MAX_LD_TASKS];
+
+// The task that's running, or the one that ran last.
+extern struct Task* current_task;
+extern uint8_t task_idx;
+
+#ifdef STACK_GUARD
+// The first bytes of each task's stack are set to this, and the task has overflowed if they change.
+#define STACK_GUARD_WORD 0xC35A
+#define STACK_GUARD_SIZE 2
+#else
+#define STACK_GUARD_SIZE 0
+#endif
+
+// Wake the tasks that are due or got UART data, then run the next ready task until it switches back to the
+// kernel. Returns false if no task was ready.
+bool dispatch_next();
+
+// Stop a task that did something it shouldn't have and tell the host why. Defined by the kernel's front end.
+void fault_task(uint8_t idx, uint8_t fault);
@@ -0,0 +1,79 @@
+#include "events.h"
+#include "run_queue.h"
+#include "serial.h"
+#include "syscalls.h"
+
+// Referenced in assembly code.
+extern volatile struct Task* current_task;
+
+// Used to track which task is active.
+extern uint8_t task_idx;
+
+// Events that have been posted to each task but not returned by wait_event yet.
+static uint8_t events_pending[MAX_LD_TASKS];
+// The mask each task is waiting on, or 0 if it isn't in wait_event.
+static uint8_t events_waiting[MAX_LD_TASKS];
+
+void reset_events() {
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		events_pending[i] = 0;
+		events_waiting[i] = 0;
+	}
+}
+
+// The UART event isn't latched. It's set for as long as the task has data to read.
+static uint8_t get_events(uint8_t idx) {
+	uint8_t events = events_pending[idx];
+	if (USART_Rx_Bytes_Buffered(idx + 1) > 0) {
+		events |= EVENT_USART_RX;
+	}
+	return events;
+}
+
+uint8_t wait_event(uint8_t mask, uint32_t timeout) {
+	uint8_t events = get_events(task_idx) & mask;
+	if (!events) {
+		events_waiting[task_idx] = mask;
+		if (timeout == 0) {
+			run_queue_block(task_idx);
+		} else {
+			current_task->next_run = get_time() + timeout;
+		}
+		suspend_task();
+		events_waiting[task_idx] = 0;
+		events = get_events(task_idx) & mask;
+	}
+	events_pending[task_idx] &= ~events;
+	return events;
+}
+
+// Move a waiting task to the ready bitmap, whether it was blocked or sleeping until its timeout.
+static void wake_task(uint8_t idx) {
+	events_waiting[idx] = 0;
+	run_queue_remove(idx);
+	run_queue_ready(idx);
+}
+
+void post_event(uint8_t idx, uint8_t mask) {
+	if (idx >= MAX_LD_TASKS) {
+		return;
+	}
+	events_pending[idx] |= mask & ~EVENT_USART_RX;
+	if (events_waiting[idx] & mask) {
+		wake_task(idx);
+	}
+}
+
+void post_usart_rx_event() {
+	// Each task has its own receive channel, so only wake the ones that got data.
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if ((events_waiting[i] & EVENT_USART_RX) && USART_Rx_Bytes_Buffered(i + 1) > 0) {
+			wake_task(i);
+		}
+	}
+}
+
+void clear_task_events(uint8_t idx) {
+	events_pending[idx] = 0;
+	events_waiting[idx] = 0;
+}
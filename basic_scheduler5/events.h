@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// Event flags let a task sleep until something happens instead of polling.
+// Each task has 8 event bits. EVENT_USART_RX is set while the task has unread UART
+// data. The other bits are latched when posted and cleared when wait_event returns them.
+
+// Clear the pending events and waits for all the tasks.
+void reset_events();
+
+// Wait until one of the events in mask is set for the current task, or timeout ticks pass.
+// A timeout of 0 waits forever. Returns the events from mask that were set, or 0 on a timeout.
+uint8_t wait_event(uint8_t mask, uint32_t timeout);
+
+// Set events for a task, waking it if it's waiting on any of them.
+void post_event(uint8_t idx, uint8_t mask);
+
+// Wake the tasks waiting on EVENT_USART_RX that have data to read. Called by the kernel when the UART receives
+// data.
+void post_usart_rx_event();
+
+// Stop a task from waiting on events and clear its pending events. Used when a task is disabled.
+void clear_task_events(uint8_t idx);
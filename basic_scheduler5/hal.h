@@ -0,0 +1,11 @@
+#pragma once
+
+// The hardware the kernel core touches, so the core can also be built natively with HAL_HOST defined and run
+// against a simulated timer and UART. See host/Makefile.
+// The flash and EEPROM handling in main.c is AVR only and isn't part of the core.
+
+#ifdef HAL_HOST
+	#include "host/hal_host.h"
+#else
+	#include "hal_avr.h"
+#endif
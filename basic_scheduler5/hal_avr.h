@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#ifndef F_CPU
+	#define F_CPU 16000000
+#endif
+
+// Run the following block with interrupts disabled, restoring the interrupt state afterwards.
+#define HAL_ATOMIC ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+
+#define HAL_ISR(vector) ISR(vector)
+
+// Read the timer1 counter.
+static inline uint16_t hal_timer1_read() {
+	// From datasheet: "Each 16-bit timer has a single 8-bit register for temporary storing of the
+	// high byte of the 16-bit access... For a 16-bit read, the low byte must be read before the high byte."
+	uint16_t value = TCNT1L;
+	value |= TCNT1H << 8;
+	return value;
+}
+
+// Returns true if timer1 has overflowed and the interrupt hasn't run yet.
+static inline bool hal_timer1_overflow_pending() {
+	return TIFR1 & (1 << TOV1);
+}
+
+static inline void hal_uart_init(uint32_t baud) {
+	/* Set baud rate */
+	// UBRR = F_OSC/(8 * baud) - 1
+	// For 16MHz and 115200 baud = 16.36. 16 gives rate 117647.
+	// Add 0.5 to apply rounding.
+	// Much more efficient to do this without floating point eventually.
+	uint16_t ubbr_calc = ((double)F_CPU) / (8.0 * (double)baud) - 1.0 + 0.5;
+	UBRR0L = ubbr_calc;
+	/* Enable double rate clock gen */
+	UCSR0A = (1<<U2X0);
+	//Enable receiver and transmitter and Rx interrupt.
+	//Since the Tx ready interrupt triggers continuously if nothing is being sent, it will only be enabled during writes.
+	UCSR0B = (1<<RXCIE0)|(1<<RXEN0)|(1<<TXEN0);
+	/* Set frame format: 8data*/
+	UCSR0C = (3<<UCSZ00);
+}
+
+// Enable or disable the interrupt for when the UART can take another byte to send.
+static inline void hal_uart_tx_irq(bool enable) {
+	if (enable) {
+		UCSR0B |= 1<<UDRIE0;
+	} else {
+		UCSR0B &= ~(1<<UDRIE0);
+	}
+}
+
+static inline void hal_uart_write(uint8_t data) {
+	UDR0 = data;
+}
+
+static inline uint8_t hal_uart_read() {
+	return UDR0;
+}
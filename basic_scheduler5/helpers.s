@@ -1,5 +1,6 @@
 ; Formatting based on https://ucexperiment.wordpress.com/2012/02/09/mixing-c-and-assembly-in-avr-gcc-and-avr-studio-4/
 #include <avr/io.h>
+#include "config.h"
 
 ; Make these visible to the C code.
 .global start_task
@@ -8,6 +9,7 @@
 ; Switch the stack from the main kernel stack to the custom stack pointed to by current_task
 start_task:
     ; Store the preserved registers for kernel
+#ifndef LEAN_KERNEL_SWITCH
 	push R2
 	push R3
 	push R4
@@ -24,6 +26,8 @@ start_task:
 	push R15
 	push R16
 	push R17
+#endif
+	; The kernel may use Y as its frame pointer, which can't be marked as clobbered, so it's always saved.
 	push R28
 	push R29
 	; Save the stack pointer register to kernel_sp
@@ -107,6 +111,7 @@ suspend_task:
 	; Restore the preserved registers for kernel
 	pop R29
 	pop R28
+#ifndef LEAN_KERNEL_SWITCH
 	pop R17
 	pop R16
 	pop R15
@@ -123,5 +128,80 @@ suspend_task:
 	pop R4
 	pop R3
 	pop R2
+#endif
 	; return to the main task
 	ret
+
+#ifdef PREEMPTIVE
+.global TIMER0_COMPA_vect
+
+; Fires every 1ms while a task is running. Once the task has used up its time slice, store the registers that
+; suspend_task doesn't, then call suspend_task so the task's stack looks like it suspended itself from inside
+; this ISR. When start_task resumes the task, it returns to the end of this ISR which restores the rest.
+TIMER0_COMPA_vect:
+	push r0
+	in r0, _SFR_IO_ADDR(SREG)
+	push r0
+	push r1
+	clr r1
+	push r18
+	push r19
+	push r20
+	push r21
+	push r22
+	push r23
+	push r24
+	push r25
+	push r26
+	push r27
+	push r30
+	push r31
+	; preempt_ticks_left is 0 while the kernel is running.
+	lds r24, preempt_ticks_left
+	tst r24
+	breq preempt_exit
+	dec r24
+	brne preempt_store
+	; The time slice is used up. Only preempt while the task is executing its own code. In a syscall, kernel
+	; state like the UART buffers may be half updated, so try again on the next tick instead.
+	ldi r24, 1
+	; The return address pushed by the interrupt is above the 15 bytes pushed here and is stored big endian.
+	in r30, _SFR_IO_ADDR(SPL)
+	in r31, _SFR_IO_ADDR(SPH)
+	ldd r19, Z+16
+	ldd r18, Z+17
+	; Check if the word address is in TASK_PGRM_MEM.
+	cpi r18, pm_lo8(TASK_PGRM_MEM)
+	ldi r20, pm_hi8(TASK_PGRM_MEM)
+	cpc r19, r20
+	brlo preempt_store
+	cpi r18, pm_lo8(TASK_PGRM_MEM + TASK_PRGM_MEM_SIZE)
+	ldi r20, pm_hi8(TASK_PGRM_MEM + TASK_PRGM_MEM_SIZE)
+	cpc r19, r20
+	brsh preempt_store
+	; Leaving preempt_ticks_left at 0 tells the kernel the task was preempted.
+	sts preempt_ticks_left, r1
+	rcall suspend_task
+	; The task is resumed here by start_task.
+	rjmp preempt_exit
+preempt_store:
+	sts preempt_ticks_left, r24
+preempt_exit:
+	pop r31
+	pop r30
+	pop r27
+	pop r26
+	pop r25
+	pop r24
+	pop r23
+	pop r22
+	pop r21
+	pop r20
+	pop r19
+	pop r18
+	pop r1
+	pop r0
+	out _SFR_IO_ADDR(SREG), r0
+	pop r0
+	reti
+#endif
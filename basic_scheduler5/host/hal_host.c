@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <ucontext.h>
+
+#include "dispatch.h"
+#include "hal.h"
+#include "slip.h"
+
+static uint32_t sim_ticks = 0;
+
+uint16_t hal_timer1_read() {
+	sim_advance(1);
+	return sim_ticks & 0xFFFF;
+}
+
+bool hal_timer1_overflow_pending() {
+	return false;
+}
+
+void sim_advance(uint32_t ticks) {
+	uint32_t start = sim_ticks;
+	sim_ticks += ticks;
+	uint16_t overflows = (sim_ticks >> 16) - (start >> 16);
+	while (overflows-- > 0) {
+		TIMER1_OVF_vect();
+	}
+}
+
+uint32_t sim_time() {
+	return sim_ticks;
+}
+
+static void sim_write_stdout(uint8_t data) {
+	putchar(data);
+}
+
+void (*sim_uart_output)(uint8_t data) = sim_write_stdout;
+
+static bool sim_tx_irq_enabled = false;
+// The byte the receive interrupt reads.
+static uint8_t sim_rx_data = 0;
+
+void hal_uart_init(uint32_t baud) {
+	(void)baud;
+}
+
+void hal_uart_tx_irq(bool enable) {
+	// The interrupt disables itself once the buffer is empty.
+	bool start = enable && !sim_tx_irq_enabled;
+	sim_tx_irq_enabled = enable;
+	if (start) {
+		while (sim_tx_irq_enabled) {
+			USART_UDRE_vect();
+		}
+	}
+}
+
+void hal_uart_write(uint8_t data) {
+	sim_uart_output(data);
+}
+
+uint8_t hal_uart_read() {
+	return sim_rx_data;
+}
+
+static void sim_uart_receive_byte(uint8_t data) {
+	sim_rx_data = data;
+	USART_RX_vect();
+}
+
+static void sim_uart_receive_escaped(uint8_t data) {
+	if (data == SLIP_END) {
+		sim_uart_receive_byte(SLIP_ESC);
+		data = SLIP_ESC_END;
+	} else if (data == SLIP_ESC) {
+		sim_uart_receive_byte(SLIP_ESC);
+		data = SLIP_ESC_ESC;
+	}
+	sim_uart_receive_byte(data);
+}
+
+void sim_uart_receive(uint8_t channel, const void* data, uint8_t len) {
+	sim_uart_receive_byte(SLIP_END);
+	sim_uart_receive_escaped(channel);
+	for (uint8_t i = 0; i < len; i++) {
+		sim_uart_receive_escaped(((const uint8_t*)data)[i]);
+	}
+	sim_uart_receive_byte(SLIP_END);
+}
+
+// The tasks run on their own host stacks. The AVR sized stacks in the kernel aren't used.
+#define SIM_STACK_SIZE (64 * 1024)
+static uint8_t sim_stacks[MAX_LD_TASKS][SIM_STACK_SIZE];
+static ucontext_t sim_task_contexts[MAX_LD_TASKS];
+static ucontext_t sim_kernel_context;
+static void (*sim_task_entries[MAX_LD_TASKS])(void);
+
+static void sim_task_main(int idx) {
+	sim_task_entries[idx]();
+	tasks[idx].enabled = false;
+	suspend_task();
+}
+
+void sim_task_start(uint8_t idx, void (*entry)(void)) {
+	sim_task_entries[idx] = entry;
+	ucontext_t* context = sim_task_contexts + idx;
+	getcontext(context);
+	context->uc_stack.ss_sp = sim_stacks[idx];
+	context->uc_stack.ss_size = SIM_STACK_SIZE;
+	context->uc_link = NULL;
+	makecontext(context, (void (*)(void))sim_task_main, 1, (int)idx);
+	// The host stacks grow down too, so the guard goes at the lowest address.
+	tasks[idx].stack_start = sim_stacks[idx];
+#ifdef STACK_GUARD
+	*(uint16_t*)tasks[idx].stack_start = STACK_GUARD_WORD;
+#endif
+}
+
+void start_task(void) {
+	swapcontext(&sim_kernel_context, sim_task_contexts + task_idx);
+}
+
+void suspend_task(void) {
+	swapcontext(sim_task_contexts + task_idx, &sim_kernel_context);
+}
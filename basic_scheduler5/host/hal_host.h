@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// The simulated hardware for the host build. Time only moves when the simulation advances it, so runs are
+// repeatable, and the interrupts are plain functions the simulation calls directly.
+
+#ifdef PREEMPTIVE
+	#error "Preemption isn't simulated in the host build."
+#endif
+
+// Nothing can interrupt the simulated kernel, so this just runs the block once.
+#define HAL_ATOMIC for (uint8_t hal_atomic_once = 1; hal_atomic_once; hal_atomic_once = 0)
+
+#define HAL_ISR(vector) void vector(void)
+
+void TIMER1_OVF_vect(void);
+void USART_UDRE_vect(void);
+void USART_RX_vect(void);
+
+// Each read of the timer advances the simulated time by a tick so code that polls the time makes progress.
+uint16_t hal_timer1_read();
+// The overflow interrupt is always run as soon as the timer overflows.
+bool hal_timer1_overflow_pending();
+
+void hal_uart_init(uint32_t baud);
+// The simulated UART sends instantly, so enabling the interrupt drains the whole transmit buffer.
+void hal_uart_tx_irq(bool enable);
+void hal_uart_write(uint8_t data);
+uint8_t hal_uart_read();
+
+// Move the simulated time forward, running the timer1 overflow interrupt as it wraps.
+void sim_advance(uint32_t ticks);
+
+// The simulated time in timer1 ticks.
+uint32_t sim_time();
+
+// Receive a packet for a channel through the receive interrupt, framed the same way the client sends it.
+void sim_uart_receive(uint8_t channel, const void* data, uint8_t len);
+
+// Called with each byte the kernel sends. Defaults to writing to stdout.
+extern void (*sim_uart_output)(uint8_t data);
+
+// Set up the context for a task so the next switch to it starts running entry on a host sized stack.
+// If entry returns the task is disabled.
+void sim_task_start(uint8_t idx, void (*entry)(void));
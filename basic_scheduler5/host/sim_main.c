@@ -0,0 +1,128 @@
+// Runs the kernel core natively with a few built in tasks against the simulated timer and UART.
+// Usage: sim [simulated ms to run for]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dispatch.h"
+#include "events.h"
+#include "hal.h"
+#include "locks.h"
+#include "run_queue.h"
+#include "serial.h"
+#include "stats.h"
+
+// Each tick of timer1 is 4us.
+#define TICKS_TO_MS(ticks) ((ticks) / TICKS_PER_MS)
+
+#define TICKER_PERIOD_MS 10
+#define WORKER_LOCK 1
+
+// Wakes up on a fixed period and reports every second.
+static void ticker_task() {
+	uint32_t deadline = get_time();
+	uint16_t count = 0;
+	while (1) {
+		deadline += TICKER_PERIOD_MS * TICKS_PER_MS;
+		sleep_until(deadline);
+		if (++count % (1000 / TICKER_PERIOD_MS) == 0) {
+			char text[32];
+			uint8_t len = snprintf(text, sizeof(text), "tick %u\n", count);
+			USART_Send(text, len);
+		}
+	}
+}
+
+// Sends back what it receives in upper case.
+static void echo_task() {
+	while (1) {
+		uint8_t data;
+		while (usart_read(&data, 1)) {
+			if (data >= 'a' && data <= 'z') {
+				data -= 'a' - 'A';
+			}
+			USART_Send(&data, 1);
+		}
+		wait_event(EVENT_USART_RX, 0);
+	}
+}
+
+// Two of these share a lock they hold while busy and while sleeping, so they wait on each other.
+static void worker_task() {
+	while (1) {
+		mutex_lock(WORKER_LOCK);
+		uint32_t busy_until = get_time() + 2 * TICKS_PER_MS;
+		while (!is_time_past(busy_until));
+		delay_ms(1);
+		mutex_unlock(WORKER_LOCK);
+		delay_ms(5);
+	}
+}
+
+static void add_task(uint8_t idx, const char* name, uint8_t priority, void (*entry)(void)) {
+	struct Task* task = tasks + idx;
+	strncpy(task->name, name, sizeof(task->name) - 1);
+	task->size = 1;
+	task->base_priority = priority;
+	task->priority = priority;
+	sim_task_start(idx, entry);
+	STATS_RESET(idx);
+	task->enabled = true;
+	task->next_run = get_time();
+	run_queue_sleep(idx);
+}
+
+void fault_task(uint8_t idx, uint8_t fault) {
+	printf("\ntask %u stopped with fault %u\n", idx, fault);
+	tasks[idx].enabled = false;
+	tasks[idx].fault = fault;
+	run_queue_remove(idx);
+	cleanup_task(idx);
+}
+
+int main(int argc, char** argv) {
+	uint32_t run_ms = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	setup_scheduler_funcs();
+	run_queue_init();
+	USART_Init(115200);
+
+	add_task(0, "ticker", 2, ticker_task);
+	add_task(1, "echo", 1, echo_task);
+	add_task(2, "worker a", 0, worker_task);
+	add_task(3, "worker b", 0, worker_task);
+
+	uint32_t end = sim_time() + run_ms * TICKS_PER_MS;
+	bool input_sent = false;
+	while ((int32_t)(end - sim_time()) > 0) {
+		if (!input_sent && sim_time() >= 100 * TICKS_PER_MS) {
+			// This has to fit in the task's receive buffer.
+			const char input[] = "hello\n";
+			sim_uart_receive(2, input, sizeof(input) - 1);
+			input_sent = true;
+		}
+		if (dispatch_next()) {
+			continue;
+		}
+		// Skip ahead to the next wake up instead of polling the time.
+		uint32_t wake_time;
+		uint32_t idle = 1;
+		if (run_queue_next_wake(&wake_time) && (int32_t)(wake_time - sim_time()) > 0) {
+			idle = wake_time - sim_time();
+		}
+		sim_advance(idle);
+		STATS_ADD_IDLE(idle);
+	}
+
+#ifdef TASK_STATS
+	printf("\n%-10s %9s %10s %12s %14s %7s\n", "task", "run ms", "switches", "max run ms", "lock wait ms", "missed");
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		const struct TaskStats* stats = stats_get(i);
+		printf("%-10s %9lu %10lu %12.2f %14lu %7u\n", tasks[i].name, (unsigned long)TICKS_TO_MS(stats->run_ticks),
+		       (unsigned long)stats->dispatches, stats->max_slice_ticks / (double)TICKS_PER_MS,
+		       (unsigned long)TICKS_TO_MS(stats->lock_wait_ticks), stats->missed_deadlines);
+	}
+	printf("idle %lu ms of %lu ms\n", (unsigned long)TICKS_TO_MS(stats_get_idle()), (unsigned long)run_ms);
+#endif
+	return 0;
+}
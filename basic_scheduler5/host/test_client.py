@@ -0,0 +1,125 @@
+"""Checks that the kernel decodes what client.py sends for a task the way client.py expects.
+
+The relocations patched by reloc.h in test_reloc are compared with apply_relocs, and the pages compressed by
+lz_compress_pages are decoded by lz.h in test_lz. Both run on random tasks from a fixed seed.
+
+python test_client.py --reloc ./test_reloc --lz ./test_lz
+"""
+
+from argparse import ArgumentParser
+import os
+import random
+import struct
+import subprocess
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'python'))
+import client  # noqa: E402
+
+# The relocation types patched as a whole word, which can start on any byte in .data. The rest are in instructions,
+# which are word aligned.
+WORD_RELOC_TYPES = (client.RELOC_WORD, client.RELOC_WORD_PM, client.RELOC_DATA_WORD)
+LDI_RELOC_TYPES = (client.RELOC_LDI_LO, client.RELOC_LDI_HI, client.RELOC_LDI_PM_LO, client.RELOC_LDI_PM_HI,
+                   client.RELOC_DATA_LDI_LO, client.RELOC_DATA_LDI_HI)
+
+
+def random_code(rng, size):
+    """Returns bytes with enough repeats in them to compress, like code does."""
+    code = bytearray()
+    while len(code) < size:
+        if code and rng.random() < 0.5:
+            start = rng.randrange(max(0, len(code) - 255), len(code))
+            code += code[start:start + rng.randrange(1, 40)]
+        else:
+            code += bytes(rng.randrange(256) for _ in range(rng.randrange(1, 20)))
+    return bytes(code[:size])
+
+
+def random_relocs(rng, size, data_size):
+    relocs = []
+    offset = 0
+    while True:
+        offset += rng.randrange(1, 24)
+        reloc_type = rng.choice(WORD_RELOC_TYPES + LDI_RELOC_TYPES)
+        if reloc_type in LDI_RELOC_TYPES:
+            offset += offset % 2
+            if rng.random() < 0.3:
+                reloc_type |= client.RELOC_NEG
+        if offset + 1 >= size:
+            return relocs
+        data = (reloc_type & ~client.RELOC_NEG) >= client.RELOC_DATA_WORD
+        relocs.append((offset, reloc_type, rng.randrange(data_size + 1) if data else rng.randrange(size)))
+        offset += 1
+
+
+def check_relocs(program, rng, count):
+    cases = []
+    stdin = bytearray()
+    for _ in range(count):
+        code = random_code(rng, rng.randrange(2, 2048))
+        relocs = random_relocs(rng, len(code), rng.randrange(64))
+        base = rng.randrange(0x10000)
+        data_base = rng.randrange(0x10000)
+        cases.append(client.apply_relocs(code, relocs, base, data_base))
+        stdin += struct.pack('<HHH', base, data_base, len(code)) + code + struct.pack('<H', len(relocs))
+        for reloc in relocs:
+            stdin += struct.pack(client.reloc_format, *reloc)
+    stdout = subprocess.run([program], input=bytes(stdin), stdout=subprocess.PIPE, check=True).stdout
+    failures = 0
+    for (i, expected) in enumerate(cases):
+        if stdout[:len(expected)] != expected:
+            failures += 1
+            print(f'reloc case {i}: reloc_apply_page didn\'t match apply_relocs')
+        stdout = stdout[len(expected):]
+    print(f'{count} relocated tasks, {failures} failures')
+    return failures
+
+
+def check_lz(program, rng, count):
+    cases = []
+    stdin = bytearray()
+    for _ in range(count):
+        task_data = random_code(rng, rng.randrange(1, 16 * client.PAGE_SIZE))
+        # The pages are patched after they're decoded, and the matches into the previous page see that.
+        patched_data = bytearray(task_data)
+        for _ in range(len(task_data) // 16):
+            patched_data[rng.randrange(len(task_data))] = rng.randrange(256)
+        num_pages = (len(task_data) + client.PAGE_SIZE - 1) // client.PAGE_SIZE
+        send_pages = [i for i in range(num_pages) if rng.random() < 0.7]
+        pages = client.lz_compress_pages(task_data, send_pages, patched_data)
+        expected = bytearray()
+        stdin.append(num_pages)
+        for i in range(num_pages):
+            stdin.append(i in pages)
+            if i in pages:
+                page = slice(i * client.PAGE_SIZE, (i + 1) * client.PAGE_SIZE)
+                stdin += struct.pack('<H', len(pages[i])) + pages[i]
+                stdin += bytes([len(task_data[page])]) + patched_data[page]
+                expected += task_data[page]
+        cases.append(bytes(expected))
+    stdout = subprocess.run([program], input=bytes(stdin), stdout=subprocess.PIPE, check=True).stdout
+    failures = 0
+    for (i, expected) in enumerate(cases):
+        if stdout[:len(expected)] != expected:
+            failures += 1
+            print(f'lz case {i}: the decoded pages didn\'t match')
+        stdout = stdout[len(expected):]
+    print(f'{count} compressed tasks, {failures} failures')
+    return failures
+
+
+def main():
+    parser = ArgumentParser(description='Check the kernel decodes tasks the way client.py sends them.')
+    parser.add_argument('--reloc', default='./test_reloc', help='The program built from test_reloc.c.')
+    parser.add_argument('--lz', default='./test_lz', help='The program built from test_lz.c.')
+    parser.add_argument('--count', type=int, default=200, help='The number of random tasks for each check.')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    failures = check_relocs(args.reloc, rng, args.count) + check_lz(args.lz, rng, args.count)
+    sys.exit(1 if failures else 0)
+
+
+if __name__ == '__main__':
+    main()
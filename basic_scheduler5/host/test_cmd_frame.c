@@ -0,0 +1,195 @@
+// Feeds cmd_frame_push damaged frames the way check_scheduler_cmds in main.c does, and checks that it never accepts
+// one and that the next good frame always gets through.
+// Usage: test_cmd_frame [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cmd_frame.h"
+#include "slip.h"
+
+// A frame can be longer than the parser allows so the oversize ones fit.
+#define MAX_FRAME (1 + 2 * CMD_FRAME_MAX_BODY + 2)
+
+enum Damage {
+	DAMAGE_TRUNCATE,
+	DAMAGE_OVERSIZE,
+	DAMAGE_BIT_FLIP,
+	DAMAGE_COUNT
+};
+
+static const char* damage_names[DAMAGE_COUNT] = {"truncated", "oversize", "bit flipped"};
+
+static uint32_t rng_state = 1;
+static int failures = 0;
+
+// xorshift32, so the runs are the same everywhere.
+static uint32_t next_random() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32_t random_below(uint32_t n) {
+	return next_random() % n;
+}
+
+static void fail(uint32_t iteration, const char* what) {
+	if (failures++ < 10) {
+		printf("iteration %u: %s\n", iteration, what);
+	}
+}
+
+// Build a frame with a body of body_len bytes and the length byte set to match. Returns the frame's length.
+static uint8_t make_frame(uint8_t* frame, uint8_t body_len) {
+	frame[0] = body_len;
+	uint16_t crc = cmd_frame_crc_update(0xFFFF, body_len);
+	for (uint8_t i = 0; i < body_len; i++) {
+		frame[1 + i] = random_below(256);
+		crc = cmd_frame_crc_update(crc, frame[1 + i]);
+	}
+	frame[1 + body_len] = crc & 0xFF;
+	frame[2 + body_len] = crc >> 8;
+	return body_len + 3;
+}
+
+// Push the bytes like check_scheduler_cmds does. After an error the rest of what's buffered is dropped, which is
+// modelled as the rest of the frame. Returns the number of frames accepted, and copies the last one to accepted.
+static uint8_t push_frame(struct CmdFrameParser* parser, const uint8_t* frame, uint8_t len, uint8_t* accepted) {
+	uint8_t count = 0;
+	for (uint8_t i = 0; i < len; i++) {
+		enum CmdFrameResult result = cmd_frame_push(parser, frame[i]);
+		if (result == CMD_FRAME_ERROR) {
+			break;
+		} else if (result == CMD_FRAME_READY) {
+			memcpy(accepted, parser->body, parser->len);
+			count++;
+		}
+	}
+	return count;
+}
+
+// The host waits for a response before sending anything else, which is longer than CMD_FRAME_TIMEOUT, so a partial
+// frame is dropped before the next one arrives.
+static void wait_for_timeout(struct CmdFrameParser* parser) {
+	if (cmd_frame_in_progress(parser)) {
+		cmd_frame_reset(parser);
+	}
+}
+
+static void damage_frame(uint8_t* frame, uint8_t* len, enum Damage damage) {
+	switch (damage) {
+		case DAMAGE_TRUNCATE:
+			*len = random_below(*len);
+			break;
+		case DAMAGE_OVERSIZE:
+			*len = make_frame(frame, CMD_FRAME_MAX_BODY + 1 + random_below(CMD_FRAME_MAX_BODY));
+			break;
+		case DAMAGE_BIT_FLIP: {
+			// The CRC finds any 3 bit flips in a frame this short. The length byte is left alone, since with a
+			// different length the CRC is checked against other bytes and 1 in 65536 of those would match.
+			uint8_t flips = 1 + random_below(3);
+			uint16_t bits[3];
+			for (uint8_t i = 0; i < flips; i++) {
+				// The bits are different so they don't cancel out.
+				bool repeated;
+				do {
+					bits[i] = 8 + random_below((*len - 1) * 8);
+					repeated = false;
+					for (uint8_t j = 0; j < i; j++) {
+						repeated |= bits[j] == bits[i];
+					}
+				} while (repeated);
+				frame[bits[i] / 8] ^= 1 << (bits[i] % 8);
+			}
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+// The frames the kernel writes should come out of the parser once the SLIP escapes are taken out, as serial.c does.
+static uint8_t writer_out[2 * MAX_FRAME + 2];
+static uint8_t writer_out_len;
+
+static void writer_byte(uint8_t data) {
+	writer_out[writer_out_len++] = data;
+}
+
+static void check_writer(struct CmdFrameParser* parser, uint32_t iteration) {
+	uint8_t payload[CMD_FRAME_MAX_BODY - 2];
+	uint8_t payload_len = random_below(sizeof(payload) + 1);
+	for (uint8_t i = 0; i < payload_len; i++) {
+		// Make the SLIP special bytes common.
+		payload[i] = random_below(2) ? random_below(256) : (random_below(2) ? SLIP_END : SLIP_ESC);
+	}
+	uint8_t seq = random_below(256);
+	uint8_t type = random_below(256);
+	struct CmdFrameWriter writer = {0, writer_byte};
+	writer_out_len = 0;
+	cmd_frame_begin(&writer, payload_len, seq, type);
+	cmd_frame_write(&writer, payload, payload_len);
+	cmd_frame_end(&writer);
+
+	uint8_t frame[MAX_FRAME];
+	uint8_t len = 0;
+	bool escaped = false;
+	for (uint8_t i = 0; i < writer_out_len; i++) {
+		uint8_t data = writer_out[i];
+		if (data == SLIP_END) {
+			continue;
+		} else if (data == SLIP_ESC) {
+			escaped = true;
+			continue;
+		} else if (escaped) {
+			data = data == SLIP_ESC_END ? SLIP_END : SLIP_ESC;
+			escaped = false;
+		}
+		frame[len++] = data;
+	}
+	uint8_t accepted[CMD_FRAME_MAX_BODY];
+	if (push_frame(parser, frame, len, accepted) != 1 || accepted[0] != seq || accepted[1] != type ||
+	    parser->len != payload_len + 2 || memcmp(accepted + 2, payload, payload_len) != 0) {
+		fail(iteration, "a frame from cmd_frame_begin wasn't received");
+	}
+}
+
+int main(int argc, char** argv) {
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	struct CmdFrameParser parser;
+	cmd_frame_reset(&parser);
+	uint32_t counts[DAMAGE_COUNT] = {0};
+
+	for (uint32_t i = 0; i < iterations; i++) {
+		uint8_t frame[MAX_FRAME];
+		uint8_t accepted[CMD_FRAME_MAX_BODY];
+		uint8_t len = make_frame(frame, 2 + random_below(CMD_FRAME_MAX_BODY - 1));
+		enum Damage damage = random_below(DAMAGE_COUNT);
+		damage_frame(frame, &len, damage);
+		counts[damage]++;
+		if (push_frame(&parser, frame, len, accepted) != 0) {
+			char what[64];
+			snprintf(what, sizeof(what), "a %s frame was accepted", damage_names[damage]);
+			fail(i, what);
+		}
+		wait_for_timeout(&parser);
+
+		// The next frame after the damaged one has to get through.
+		uint8_t good[MAX_FRAME];
+		uint8_t good_len = make_frame(good, 2 + random_below(CMD_FRAME_MAX_BODY - 1));
+		if (push_frame(&parser, good, good_len, accepted) != 1 || parser.len != good[0] ||
+		    memcmp(accepted, good + 1, good[0]) != 0) {
+			fail(i, "the frame after a damaged one wasn't received");
+		}
+		wait_for_timeout(&parser);
+
+		check_writer(&parser, i);
+	}
+
+	printf("%u iterations: %u truncated, %u oversize, %u bit flipped, %d failures\n", iterations,
+	       counts[DAMAGE_TRUNCATE], counts[DAMAGE_OVERSIZE], counts[DAMAGE_BIT_FLIP], failures);
+	return failures > 0;
+}
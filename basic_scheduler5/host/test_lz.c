@@ -0,0 +1,90 @@
+// Decodes compressed task pages with lz.h in two page buffers like HandleWriteCmd does, so test_client.py can check
+// them against what lz_compress_pages in client.py was given.
+// Reads tasks from stdin until it ends, each as: number of pages, then for each page whether it was sent. A sent
+// page is followed by the length of its tokens, the tokens, the length of the page, and the page once it's patched,
+// which replaces it in the buffer like the relocations do in the kernel. The 16 bit values are little endian. Writes
+// the decoded bytes of each sent page to stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz.h"
+
+#define PAGE_SIZE 128
+// The stream for a page that doesn't compress is a little longer than the page.
+#define MAX_STREAM (2 * PAGE_SIZE)
+
+static bool read_bytes(void* data, size_t len) {
+	return fread(data, 1, len, stdin) == len;
+}
+
+static bool read_word(uint16_t* value) {
+	uint8_t bytes[2];
+	if (!read_bytes(bytes, 2)) {
+		return false;
+	}
+	*value = bytes[0] | (uint16_t)bytes[1] << 8;
+	return true;
+}
+
+static int bad_input() {
+	fprintf(stderr, "test_lz: bad input\n");
+	return 1;
+}
+
+int main() {
+	// The two page buffers, which are also the window.
+	static uint8_t window[2 * PAGE_SIZE];
+	uint8_t num_pages;
+	while (read_bytes(&num_pages, 1)) {
+		for (uint8_t page = 0; page < num_pages; page++) {
+			uint8_t* buffer = window + (page % 2) * PAGE_SIZE;
+			uint8_t sent;
+			if (!read_bytes(&sent, 1)) {
+				return bad_input();
+			}
+			if (!sent) {
+				// The buffer of a skipped page isn't written, so any match into it would get what was left there.
+				memset(buffer, 0xA5, PAGE_SIZE);
+				continue;
+			}
+			uint8_t stream[MAX_STREAM];
+			uint16_t stream_len;
+			uint8_t page_len;
+			uint8_t patched[PAGE_SIZE];
+			if (!read_word(&stream_len) || stream_len > MAX_STREAM || !read_bytes(stream, stream_len) ||
+			    !read_bytes(&page_len, 1) || page_len > PAGE_SIZE || !read_bytes(patched, page_len)) {
+				return bad_input();
+			}
+
+			struct LzDecoder lz = {0, 0, 0};
+			uint16_t stream_pos = 0;
+			uint8_t pos = 0;
+			while (pos < page_len) {
+				uint8_t buffer_pos = (page % 2) * PAGE_SIZE + pos;
+				if (lz_decode_copying(&lz)) {
+					window[buffer_pos] = lz_decode_copy(&lz, window, buffer_pos);
+					pos++;
+				} else if (stream_pos < stream_len) {
+					uint8_t data = stream[stream_pos++];
+					if (lz_decode_input(&lz, data)) {
+						window[buffer_pos] = data;
+						pos++;
+					}
+				} else {
+					fprintf(stderr, "test_lz: page %u ended after %u bytes\n", page, pos);
+					return 1;
+				}
+			}
+			// The tokens can't carry on into the next page.
+			if (stream_pos != stream_len || lz.literals > 0 || lz.match_len > 0) {
+				fprintf(stderr, "test_lz: page %u has tokens past its end\n", page);
+				return 1;
+			}
+			fwrite(buffer, 1, page_len, stdout);
+			memcpy(buffer, patched, page_len);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,60 @@
+// Patches task images with reloc_apply_page a page at a time like HandleWriteCmd does, so test_client.py can
+// compare the results with apply_relocs in client.py.
+// Reads images from stdin until it ends, each as: base, data base, size, the bytes, number of relocations, then
+// the relocations in the task image format. The 16 bit values are little endian. Writes each patched image to
+// stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reloc.h"
+
+#define PAGE_SIZE 128
+#define MAX_IMAGE 4096
+#define MAX_RELOCS 1024
+
+static bool read_bytes(void* data, size_t len) {
+	return fread(data, 1, len, stdin) == len;
+}
+
+static bool read_word(uint16_t* value) {
+	uint8_t bytes[2];
+	if (!read_bytes(bytes, 2)) {
+		return false;
+	}
+	*value = bytes[0] | (uint16_t)bytes[1] << 8;
+	return true;
+}
+
+int main() {
+	static uint8_t image[MAX_IMAGE];
+	static uint8_t relocs[MAX_RELOCS][TASK_RELOC_SIZE];
+	uint16_t base;
+	while (read_word(&base)) {
+		uint16_t data_base;
+		uint16_t size;
+		uint16_t num_relocs;
+		if (!read_word(&data_base) || !read_word(&size) || size > MAX_IMAGE || !read_bytes(image, size) ||
+		    !read_word(&num_relocs) || num_relocs > MAX_RELOCS || !read_bytes(relocs, num_relocs * TASK_RELOC_SIZE)) {
+			fprintf(stderr, "test_reloc: bad input\n");
+			return 1;
+		}
+		// Every relocation is offered to every page, and reloc_apply_page patches the part that's in it. The last
+		// page is patched in a full page buffer like the kernel does.
+		for (uint16_t page_start = 0; page_start < size; page_start += PAGE_SIZE) {
+			uint8_t page[PAGE_SIZE] = {0};
+			uint16_t page_len = size - page_start < PAGE_SIZE ? size - page_start : PAGE_SIZE;
+			memcpy(page, image + page_start, page_len);
+			for (uint16_t i = 0; i < num_relocs; i++) {
+				const uint8_t* reloc = relocs[i];
+				uint16_t offset = reloc[0] | (uint16_t)reloc[1] << 8;
+				uint16_t target = reloc[3] | (uint16_t)reloc[4] << 8;
+				reloc_apply_page(page, page_start, PAGE_SIZE, offset, reloc[2], target, base, data_base);
+			}
+			memcpy(image + page_start, page, page_len);
+		}
+		fwrite(image, 1, size, stdout);
+	}
+	return 0;
+}
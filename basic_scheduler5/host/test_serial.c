@@ -0,0 +1,173 @@
+// Runs random packets, reads, zero copy reads and sends through serial.c and checks them against a simple model of
+// each channel's buffer.
+// Usage: test_serial [iterations]
+//
+// serial.c is included rather than linked so the buffer sizes can be reached, like in simavr/bench_main.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dispatch.h"
+#include "hal_host.h"
+
+#include "../serial.c"
+
+// A channel past the last one, which the receive interrupt drops.
+#define TEST_CHANNELS (MAX_TASKS + 1)
+#define TEST_MAX_PACKET 12
+#define TEST_MAX_SEND 40
+
+struct ChannelModel {
+	uint8_t data[RX_CMD_BUFFER_LEN > RX_BUFFER_LEN ? RX_CMD_BUFFER_LEN : RX_BUFFER_LEN];
+	uint8_t len;
+	bool error;
+};
+
+static struct ChannelModel models[MAX_TASKS];
+static uint32_t rng_state = 1;
+static int failures = 0;
+
+static uint8_t sent[TEST_MAX_SEND];
+static uint8_t sent_len;
+static uint8_t sent_pos;
+
+// xorshift32, so the runs are the same everywhere.
+static uint32_t next_random() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32_t random_below(uint32_t n) {
+	return next_random() % n;
+}
+
+// No tasks are run.
+void fault_task(uint8_t idx, uint8_t fault) {
+}
+
+static void fail(uint32_t iteration, uint8_t channel, const char* what) {
+	if (failures++ < 10) {
+		printf("iteration %u channel %u: %s\n", iteration, channel, what);
+	}
+}
+
+static void check_output(uint8_t data) {
+	if (sent_pos >= sent_len || data != sent[sent_pos]) {
+		failures++;
+		printf("USART_Send sent the wrong byte\n");
+	}
+	sent_pos++;
+}
+
+// Drop len bytes from the front of the model.
+static void model_pop(struct ChannelModel* model, uint8_t len) {
+	memmove(model->data, model->data + len, model->len - len);
+	model->len -= len;
+}
+
+static void test_receive(uint8_t channel) {
+	uint8_t packet[TEST_MAX_PACKET];
+	uint8_t len = random_below(sizeof(packet) + 1);
+	for (uint8_t i = 0; i < len; i++) {
+		// Make the SLIP special bytes common.
+		packet[i] = random_below(4) ? random_below(256) : (random_below(2) ? SLIP_END : SLIP_ESC);
+	}
+	sim_uart_receive(channel, packet, len);
+	if (channel >= MAX_TASKS) {
+		return;
+	}
+	struct ChannelModel* model = models + channel;
+	for (uint8_t i = 0; i < len; i++) {
+		// One byte is always left empty.
+		if (model->len < RX_CHANNEL_CAPACITY(channel) - 1) {
+			model->data[model->len++] = packet[i];
+		} else {
+			model->error = true;
+		}
+	}
+}
+
+static void test_read(uint32_t iteration, uint8_t channel) {
+	struct ChannelModel* model = models + channel;
+	uint8_t data[RX_CMD_BUFFER_LEN];
+	uint8_t len = random_below(sizeof(data) + 1);
+	uint8_t read = USART_Read(channel, data, len);
+	uint8_t expected = len < model->len ? len : model->len;
+	if (read != expected || memcmp(data, model->data, read) != 0) {
+		fail(iteration, channel, "USART_Read didn't match");
+	}
+	model_pop(model, expected);
+}
+
+static void test_peek(uint32_t iteration, uint8_t channel) {
+	struct ChannelModel* model = models + channel;
+	const uint8_t* data;
+	uint8_t available = USART_Rx_Peek(channel, &data);
+	// The bytes up to the end of the buffer are returned, and the rest after the commit.
+	const uint8_t* buffer_end = (const uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel) +
+	                            RX_CHANNEL_CAPACITY(channel);
+	if (available > model->len || (available == 0 && model->len > 0) ||
+	    (available < model->len && data + available != buffer_end) || memcmp(data, model->data, available) != 0) {
+		fail(iteration, channel, "USART_Rx_Peek didn't match");
+	}
+	// Sometimes commit more than there is, which should be clamped.
+	uint8_t len = random_below(available + 3);
+	USART_Rx_Commit(channel, len);
+	model_pop(model, len < model->len ? len : model->len);
+}
+
+static void test_send(uint32_t iteration) {
+	for (uint8_t i = 0; i < sizeof(sent); i++) {
+		sent[i] = random_below(256);
+	}
+	uint8_t len = random_below(sizeof(sent) + 1);
+	uint8_t space = USART_Tx_Free_Buffer() - 1;
+	sent_len = len < space ? len : space;
+	sent_pos = 0;
+	// The simulated UART sends everything straight away.
+	if (USART_Send(sent, len) != sent_len || sent_pos != sent_len) {
+		fail(iteration, 0, "USART_Send didn't match");
+	}
+}
+
+int main(int argc, char** argv) {
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	sim_uart_output = check_output;
+	USART_Init(115200);
+
+	for (uint32_t i = 0; i < iterations; i++) {
+		uint8_t channel = random_below(TEST_CHANNELS);
+		uint8_t op = random_below(6);
+		if (op == 0) {
+			test_send(i);
+			continue;
+		}
+		if (op == 1 || channel >= MAX_TASKS) {
+			test_receive(channel);
+			continue;
+		}
+		struct ChannelModel* model = models + channel;
+		if (op == 2) {
+			test_read(i, channel);
+		} else if (op == 3) {
+			test_peek(i, channel);
+		} else if (op == 4) {
+			if (Check_New_Error(channel) != model->error) {
+				fail(i, channel, "Check_New_Error didn't match");
+			}
+			model->error = false;
+		} else if (random_below(8) == 0) {
+			USART_Rx_Clear(channel);
+			model->len = 0;
+			model->error = false;
+		}
+		if (USART_Rx_Bytes_Buffered(channel) != model->len) {
+			fail(i, channel, "USART_Rx_Bytes_Buffered didn't match");
+		}
+	}
+
+	printf("%u iterations, %d failures\n", iterations, failures);
+	return failures > 0;
+}
@@ -0,0 +1,78 @@
+// Checks task_range_is_free against a map of which flash pages the loaded tasks use, with random tasks and ranges.
+// Usage: test_task_range [iterations]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "task_range.h"
+
+#define PAGE_SIZE 128
+#define NUM_PAGES 16
+// The flash doesn't start at 0 in the kernel either.
+#define MEM_START 0x2000
+
+struct Task tasks[MAX_LD_TASKS];
+
+static uint32_t rng_state = 1;
+
+// xorshift32, so the runs are the same everywhere.
+static uint32_t next_random() {
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+static uint32_t random_below(uint32_t n) {
+	return next_random() % n;
+}
+
+// A page aligned offset in the flash and a size that ends anywhere in a page, like HandleWriteHeader gets.
+static void random_range(uint16_t* offset, uint16_t* size) {
+	uint8_t first = random_below(NUM_PAGES);
+	*offset = MEM_START + first * PAGE_SIZE;
+	*size = 1 + random_below((NUM_PAGES - first) * PAGE_SIZE);
+}
+
+int main(int argc, char** argv) {
+	uint32_t iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : 100000;
+	int failures = 0;
+	for (uint32_t iteration = 0; iteration < iterations; iteration++) {
+		// The pages each task uses. The tasks are allowed to overlap each other here since only the query is checked.
+		bool used[MAX_LD_TASKS][NUM_PAGES];
+		memset(used, 0, sizeof(used));
+		for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+			tasks[i].size = 0;
+			if (random_below(3) == 0) {
+				continue;
+			}
+			random_range(&tasks[i].task_offset, &tasks[i].size);
+			uint8_t first = (tasks[i].task_offset - MEM_START) / PAGE_SIZE;
+			for (uint16_t page = first; page * PAGE_SIZE < first * PAGE_SIZE + tasks[i].size; page++) {
+				used[i][page] = true;
+			}
+		}
+		uint8_t skip = random_below(MAX_LD_TASKS + 1);
+		uint16_t offset;
+		uint16_t size;
+		random_range(&offset, &size);
+		bool expected = true;
+		uint8_t first = (offset - MEM_START) / PAGE_SIZE;
+		for (uint16_t page = first; page * PAGE_SIZE < first * PAGE_SIZE + size; page++) {
+			for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+				if (i != skip && used[i][page]) {
+					expected = false;
+				}
+			}
+		}
+		if (task_range_is_free(skip, offset, size, PAGE_SIZE) != expected) {
+			if (failures++ < 10) {
+				printf("iteration %u: range 0x%x size %u skipping %u should %sbe free\n", iteration, offset, size, skip,
+				       expected ? "" : "not ");
+			}
+		}
+	}
+	printf("%u iterations, %d failures\n", iterations, failures);
+	return failures > 0;
+}
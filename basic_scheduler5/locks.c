@@ -0,0 +1,139 @@
+#include "locks.h"
+#include "run_queue.h"
+#include "stats.h"
+#include "syscalls.h"
+#include "trace.h"
+
+// Referenced in assembly code.
+extern volatile struct Task* current_task;
+
+// Used to track which task is active.
+extern uint8_t task_idx;
+
+// Defined in dispatch.c
+extern struct Task tasks[MAX_LD_TASKS];
+
+struct Lock {
+	// The task_idx of the task holding the lock, or LOCK_FREE.
+	uint8_t owner;
+	// Bit i is set if tasks[i] is blocked waiting for this lock.
+	task_mask_t waiters;
+};
+
+static struct Lock locks[NUM_LOCKS];
+
+void reset_locks() {
+	for (uint8_t i = 0; i < NUM_LOCKS; i++) {
+		locks[i].owner = LOCK_FREE;
+		locks[i].waiters = 0;
+	}
+}
+
+void update_task_priority(uint8_t idx) {
+	uint8_t priority = tasks[idx].base_priority;
+	for (uint8_t i = 0; i < NUM_LOCKS; i++) {
+		if (locks[i].owner != idx) {
+			continue;
+		}
+		for (uint8_t j = 0; j < MAX_LD_TASKS; j++) {
+			if ((locks[i].waiters & TASK_BIT(j)) && tasks[j].priority > priority) {
+				priority = tasks[j].priority;
+			}
+		}
+	}
+	if (priority != tasks[idx].priority) {
+		run_queue_set_priority(idx, priority);
+	}
+}
+
+void mutex_lock(uint8_t lock) {
+	if (lock >= NUM_LOCKS) {
+		return;
+	}
+	struct Lock* l = locks + lock;
+	if (l->owner == LOCK_FREE) {
+		TRACE_EVENT(TRACE_LOCK_ACQUIRE, TRACE_LOCK_ARG(task_idx, lock));
+		l->owner = task_idx;
+		return;
+	}
+	if (l->owner == task_idx) {
+		return;
+	}
+	TRACE_EVENT(TRACE_LOCK_WAIT, TRACE_LOCK_ARG(task_idx, lock));
+	l->waiters |= TASK_BIT(task_idx);
+	// Priority inheritance. Otherwise a task with a priority in between could keep the lock holder from
+	// running and releasing the lock.
+	update_task_priority(l->owner);
+	// The task won't be scheduled again until force_unlock hands it the lock.
+	run_queue_block(task_idx);
+#ifdef TASK_STATS
+	uint32_t wait_start = get_time();
+	suspend_task();
+	STATS_ADD_LOCK_WAIT(task_idx, get_time() - wait_start);
+#else
+	suspend_task();
+#endif
+}
+
+bool mutex_try_lock(uint8_t lock) {
+	if (!is_mutex_available(lock)) {
+		return false;
+	}
+	if (locks[lock].owner == LOCK_FREE) {
+		TRACE_EVENT(TRACE_LOCK_ACQUIRE, TRACE_LOCK_ARG(task_idx, lock));
+	}
+	locks[lock].owner = task_idx;
+	return true;
+}
+
+void mutex_unlock(uint8_t lock) {
+	if (is_lock_owner(lock, task_idx)) {
+		force_unlock(lock);
+	}
+}
+
+void force_unlock(uint8_t lock) {
+	if (lock >= NUM_LOCKS) {
+		return;
+	}
+	struct Lock* l = locks + lock;
+	uint8_t prev_owner = l->owner;
+	if (prev_owner != LOCK_FREE) {
+		TRACE_EVENT(TRACE_LOCK_RELEASE, TRACE_LOCK_ARG(prev_owner, lock));
+	}
+	l->owner = LOCK_FREE;
+	// Hand the lock directly to the highest priority waiter so that only one task is woken.
+	uint8_t next_owner = run_queue_wake_one(&(l->waiters));
+	if (next_owner != NO_TASK) {
+		TRACE_EVENT(TRACE_LOCK_ACQUIRE, TRACE_LOCK_ARG(next_owner, lock));
+		l->owner = next_owner;
+		// The new owner may need to inherit the priorities of the remaining waiters.
+		update_task_priority(next_owner);
+	}
+	if (prev_owner != LOCK_FREE) {
+		update_task_priority(prev_owner);
+	}
+}
+
+bool is_mutex_available(uint8_t lock) {
+	return lock < NUM_LOCKS && (locks[lock].owner == LOCK_FREE || locks[lock].owner == task_idx);
+}
+
+bool is_lock_owner(uint8_t lock, uint8_t idx) {
+	return lock < NUM_LOCKS && locks[lock].owner == idx;
+}
+
+void release_task_locks(uint8_t idx) {
+	for (uint8_t i = 0; i < NUM_LOCKS; i++) {
+		locks[i].waiters &= ~TASK_BIT(idx);
+		if (locks[i].owner == idx) {
+			force_unlock(i);
+		}
+	}
+	// The task may have been propping up the priority of a lock holder.
+	for (uint8_t i = 0; i < NUM_LOCKS; i++) {
+		if (locks[i].owner != LOCK_FREE) {
+			update_task_priority(locks[i].owner);
+		}
+	}
+}
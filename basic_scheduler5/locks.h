@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// The value of a lock's owner when no task is holding it.
+#define LOCK_FREE 0xFF
+
+// A table of NUM_LOCKS mutexes shared between the tasks. Lock 0 is the one used by get_lock/release_lock.
+// Tasks waiting on a lock are taken out of the run queue entirely until the lock is handed to them, so waiting
+// doesn't cost any scheduler passes.
+// These don't need a critical section since syscalls are never preempted.
+
+// Free all the locks and forget any waiters.
+void reset_locks();
+
+// Wait until the lock is free, then take it. Taking a lock the task already holds returns immediately.
+// While waiting, the task holding the lock inherits the waiting task's priority if it's higher.
+void mutex_lock(uint8_t lock);
+
+// Take the lock if it's free. Returns false instead of blocking if another task holds it.
+bool mutex_try_lock(uint8_t lock);
+
+// Release a lock held by the current task.
+void mutex_unlock(uint8_t lock);
+
+// Release a lock regardless of which task is holding it. The highest priority waiter (if any) gets the lock
+// and is made ready to run.
+void force_unlock(uint8_t lock);
+
+// Returns true if the lock is free or held by the current task.
+bool is_mutex_available(uint8_t lock);
+
+// Returns true if the task is holding the lock.
+bool is_lock_owner(uint8_t lock, uint8_t idx);
+
+// Set a task's priority to the higher of its base priority and the priorities of the tasks waiting on
+// locks it holds.
+void update_task_priority(uint8_t idx);
+
+// Release the locks held by a task and stop it waiting on any lock. Used when a task is disabled.
+void release_task_locks(uint8_t idx);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Compressed pages are sent as a stream of LZ tokens:
+// * 0x00-0x7F: A run of (token + 1) literal bytes follows.
+// * 0x80-0xFF: Copy (token - 0x80 + 3) bytes starting the next byte's value back in the output. The distance is
+//   1-255.
+// The decoder is fed a byte at a time so the bytes can be taken straight from the UART. The output is written to a
+// 256 byte window, so a uint8_t index wraps around it and the matches can reach anywhere in it.
+// These are inlined since HandleWriteCmd calls them for every byte of a compressed page.
+
+#define LZ_MIN_MATCH 3
+
+struct LzDecoder {
+	// The number of literal bytes left in the current run.
+	uint8_t literals;
+	// The number of bytes left to copy for the current match.
+	uint8_t match_len;
+	// How far back the current match copies from, or 0 until the byte after the token arrives.
+	uint8_t dist;
+};
+
+// Returns true if a match has bytes to copy with lz_decode_copy, so no input is needed for the next byte.
+static inline __attribute__((always_inline)) bool lz_decode_copying(const struct LzDecoder* lz) {
+	return lz->match_len > 0 && lz->dist > 0;
+}
+
+// Returns the next byte of the current match, where pos is where it will be written in the window.
+static inline __attribute__((always_inline)) uint8_t lz_decode_copy(struct LzDecoder* lz, const uint8_t* window,
+                                                                    uint8_t pos) {
+	uint8_t data = window[(uint8_t)(pos - lz->dist)];
+	lz->match_len--;
+	if (lz->match_len == 0) {
+		lz->dist = 0;
+	}
+	return data;
+}
+
+// Take a byte of the stream. Returns true if it's a literal that goes straight to the output.
+static inline __attribute__((always_inline)) bool lz_decode_input(struct LzDecoder* lz, uint8_t data) {
+	if (lz->literals > 0) {
+		lz->literals--;
+		return true;
+	}
+	if (lz->match_len > 0) {
+		lz->dist = data;
+	} else if (data & 0x80) {
+		lz->match_len = (data & 0x7F) + LZ_MIN_MATCH;
+	} else {
+		lz->literals = data + 1;
+	}
+	return false;
+}
@@ -9,59 +9,114 @@
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <avr/boot.h>
+#include <avr/sleep.h>
 #include <stdbool.h>
+#include <string.h>
 
+#include "cmd_frame.h"
+#include "config.h"
+#include "dispatch.h"
+#include "events.h"
+#include "locks.h"
+#include "lz.h"
+#include "queues.h"
+#include "reloc.h"
+#include "run_queue.h"
 #include "syscalls.h"
 #include "serial.h"
-
-// The number of loadable tasks will be 
-#ifndef MAX_TASKS
-	#define MAX_TASKS 5
-#endif
-#define MAX_LD_TASKS (MAX_TASKS - 1)
+#include "slip.h"
+#include "stats.h"
+#include "task_range.h"
+#include "trace.h"
 
 
 // Normally the stack grows from the end of the RAM range. Here we're allocating memory on the heap
 // to use as independent stacks for our tasks. The "kernel" task will have an additional stack at
 // the normal position in memory.
 // We could also do this in a linker script.
-#define STACK_SIZE 64
-uint8_t stacks[MAX_LD_TASKS * STACK_SIZE];
-#define TASK_PRGM_MEM_SIZE 2048
+// Each enabled task gets a slice of this the size it asked for when it was loaded.
+uint8_t stacks[STACK_ARENA_SIZE];
+// Each task's .data and .bss are put somewhere in here when the task is loaded.
+uint8_t task_data_arena[TASK_DATA_ARENA_SIZE];
 const uint8_t TASK_PGRM_MEM[TASK_PRGM_MEM_SIZE] PROGMEM __attribute__((aligned(SPM_PAGESIZE))) = {0};
 
 
-#define EEMPROM_PREAMBLE 0xABCD
+// Change this whenever the layout of EepromTaskEntries changes so old entries aren't misread.
+#define EEMPROM_PREAMBLE 0xABD2
+
+#define TASK_PRGM_MEM_PAGES (TASK_PRGM_MEM_SIZE / SPM_PAGESIZE)
 
 struct EepromTaskEntry {
 	uint16_t task_offset;
 	uint16_t task_size;
 	char task_name[16];
+	uint8_t task_priority;
+	// The number of relocations at the end of the task. See reloc.h.
+	uint16_t reloc_count;
+	// Where the task's .data and .bss are in task_data_arena. The initial values of .data are stored in flash
+	// before the relocations.
+	uint16_t data_addr;
+	uint8_t data_size;
+	uint8_t bss_size;
+	uint8_t stack_size;
 };
 
 struct EepromTaskEntries {
 	uint16_t eeprom_preample;
 	struct EepromTaskEntry eeprom_tasks[MAX_LD_TASKS];
+	// The number of times each page of TASK_PGRM_MEM has been erased. Used to place tasks on the least worn pages.
+	uint16_t page_erase_counts[TASK_PRGM_MEM_PAGES];
 };
 
 struct EepromTaskEntries eeprom_task_entries EEMEM;
 
-// Referenced in assembly code.
-struct Task* current_task;
-
 // For storing the "real" stack pointer. Referenced in assembly code.
 uint8_t* kernel_sp;
 
-// Used to track which task is active.
-uint8_t task_idx = 0;
+// Unused stack bytes are filled with this so the most a task has used can be found later. It's different from
+// STACK_GUARD_WORD so the usage count stops at the guard.
+#define STACK_CANARY 0xA5
+
+// Find space in the stack arena for a task, skipping over the stacks of the other enabled tasks.
+// Returns NULL if there's no space.
+static uint8_t* AllocTaskStack(uint8_t idx) {
+	uint8_t size = tasks[idx].stack_size;
+	uint8_t* start = stacks;
+	uint8_t i = 0;
+	while (i < MAX_LD_TASKS) {
+		struct Task* other = tasks + i;
+		if (i != idx && other->enabled && start < other->stack_start + other->stack_size &&
+		    other->stack_start < start + size) {
+			// Try again right after this stack. start only increases so this ends.
+			start = other->stack_start + other->stack_size;
+			i = 0;
+			continue;
+		}
+		i++;
+	}
+	if (start + size > stacks + STACK_ARENA_SIZE) {
+		return NULL;
+	}
+	return start;
+}
 
-// TODO: Need to persistently load/store the size/offset to EEPROM to persist the tasks between power cycles.
-static struct Task tasks[MAX_LD_TASKS] = {0};
+// Count the bytes at the bottom of the stack that still have the canary to find the most the task has used.
+static uint8_t GetStackUsed(uint8_t idx) {
+	uint8_t unused = STACK_GUARD_SIZE;
+	while (unused < tasks[idx].stack_size && tasks[idx].stack_start[unused] == STACK_CANARY) {
+		unused++;
+	}
+	return tasks[idx].stack_size - unused;
+}
 
 // Initialize the return pointer in the tasks' stacks.
 void setup_start_func(uint8_t task_idx) {
+	memset(tasks[task_idx].stack_start, STACK_CANARY, tasks[task_idx].stack_size);
+#ifdef STACK_GUARD
+	*(uint16_t*)tasks[task_idx].stack_start = STACK_GUARD_WORD;
+#endif
 	// Initialize the stack to the end of this tasks memory region
-	tasks[task_idx].stack_pointer = stacks + (task_idx + 1) * STACK_SIZE - 1;
+	tasks[task_idx].stack_pointer = tasks[task_idx].stack_start + tasks[task_idx].stack_size - 1;
 	// Add the function pointers to the stack. The stack grows down.
 	// The function address is the byte offset in 16bit words (divide by two).
 	// Most things are little endian, but this address is stored big endian: https://www.avrfreaks.net/forum/big-endian-or-little-endian-0
@@ -70,7 +125,8 @@ void setup_start_func(uint8_t task_idx) {
 	tasks[task_idx].stack_pointer--;
 	*(tasks[task_idx].stack_pointer) = word_addr >> 8;
 	tasks[task_idx].stack_pointer--;
-	// Space for preserved registers.
+	// Space for the 18 call-saved registers start_task pops for the task, with or without LEAN_KERNEL_SWITCH. They're
+	// popped before the task first runs, so they don't use any of its stack after that.
 	tasks[task_idx].stack_pointer -= 18;
 }
 
@@ -79,229 +135,903 @@ enum CmdTypes {
 	CMD_LIST = 1,
 	CMD_ENABLE = 2,
 	CMD_WRITE = 3,
-	CMD_DELETE = 4
+	CMD_DELETE = 4,
+	CMD_PRIORITY = 5,
+	CMD_PAGE_CRC = 6,
+	// The same as CMD_WRITE, but the pages are sent compressed.
+	CMD_WRITE_LZ = 7,
+	CMD_PLACE = 8,
+	CMD_ERASE_COUNTS = 9,
+	CMD_MOVE = 10,
+	CMD_TRACE = 11,
+	CMD_STATS = 12
 };
 
-void HandleListTasksCmd() {
-	struct Task buffer;
-	uint8_t* buffer_bytes = (uint8_t*)&buffer;
+#define READ_UART_BYTE(data) \
+  while (!(UCSR0A & (1<<RXC0))); \
+  data = UDR0;
+  
+#define WRITE_UART_BYTE(data) \
+  while (!(UCSR0A & (1<<UDRE0))); \
+  UDR0 = data;
+
+// The commands are received on UART channel 0 and framed as described in cmd_frame.h.
+static struct CmdFrameParser cmd_parser;
+// When the last byte of a command was received. Used to drop partial frames if the rest never arrives.
+static uint32_t cmd_last_rx_time = 0;
+#define CMD_FRAME_TIMEOUT (50 * TICKS_PER_MS)
+// The sequence number and CRC of the last command. If the response to a command is lost, the host sends it
+// again, and commands that change the state shouldn't be run twice.
+static uint8_t cmd_last_seq = 0;
+static uint16_t cmd_last_crc = 0;
+
+// Kernel responses can't be dropped like task output, so wait for space in the TX buffer.
+static void SendResponseByte(uint8_t data) {
+	while (!USART_Send(&data, 1));
+}
+
+static struct CmdFrameWriter cmd_writer = {0, SendResponseByte};
+
+void SendResponse(uint8_t seq, uint8_t status) {
+	cmd_frame_begin(&cmd_writer, 0, seq, status);
+	cmd_frame_end(&cmd_writer);
+}
+
+void HandleListTasksCmd(uint8_t seq) {
+	// The response needs to fit in a single frame.
+	_Static_assert(5 + MAX_LD_TASKS * sizeof(struct Task) <= 253, "Too many tasks for the list response.");
+	uint8_t buffer_bytes[5];
 	buffer_bytes[0] = MAX_LD_TASKS;
 	*((uint8_t const **)(buffer_bytes+1)) = TASK_PGRM_MEM;
 	*((uint16_t *)(buffer_bytes+3)) = TASK_PRGM_MEM_SIZE;
-	USART_Send(buffer_bytes, 5);
+	cmd_frame_begin(&cmd_writer, 5 + MAX_LD_TASKS * sizeof(struct Task), seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, buffer_bytes, 5);
 	for (int i = 0; i < MAX_LD_TASKS; i++) {
-		buffer = tasks[i];
-		uint8_t offset = 0;
-		while (offset < sizeof(struct Task)) {
-			offset += USART_Send(buffer_bytes, sizeof(struct Task) - offset);
+		if (tasks[i].enabled) {
+			tasks[i].stack_used = GetStackUsed(i);
 		}
+		cmd_frame_write(&cmd_writer, tasks + i, sizeof(struct Task));
 	}
+	cmd_frame_end(&cmd_writer);
 }
 
-#define READ_UART_BYTE(data) \
-  while (!(UCSR0A & (1<<RXC0))); \
-  data = UDR0;
-  
-#define WRITE_UART_BYTE(data) \
-  while (!(UCSR0A & (1<<UDRE0))); \
-  UDR0 = data;
+// HandleWriteCmd can't use cmd_frame_end since it would wait for the whole frame to be sent and drop received bytes.
+// The page requests are built in a buffer so they can be sent a byte at a time while receiving the page data.
+static uint8_t QueuePageRequestByte(uint8_t* out, uint8_t len, uint8_t data) {
+	if (data == SLIP_END || data == SLIP_ESC) {
+		out[len++] = SLIP_ESC;
+		data = data == SLIP_END ? SLIP_ESC_END : SLIP_ESC_ESC;
+	}
+	out[len++] = data;
+	return len;
+}
+
+// out needs space for the worst case of every byte being escaped.
+#define PAGE_REQUEST_MAX_LEN 16
+
+// Returns the number of bytes written to out.
+static uint8_t QueuePageRequest(uint8_t* out, uint8_t seq, uint16_t offset) {
+	uint8_t frame[7] = {4, seq, CMD_STATUS_PAGE, offset & 0xFF, offset >> 8};
+	uint16_t crc = 0xFFFF;
+	for (uint8_t i = 0; i < 5; i++) {
+		crc = cmd_frame_crc_update(crc, frame[i]);
+	}
+	frame[5] = crc & 0xFF;
+	frame[6] = crc >> 8;
+	uint8_t len = 0;
+	out[len++] = SLIP_END;
+	for (uint8_t i = 0; i < 7; i++) {
+		len = QueuePageRequestByte(out, len, frame[i]);
+	}
+	out[len++] = SLIP_END;
+	return len;
+}
   
-enum SpmState {
-	SPM_STATE_WRITING,
-	SPM_STATE_ERASING,
-	SPM_READY
+// The rest of the flash can't be read while a page is being erased or written, so only the functions that start the
+// erase or write and wait for it are in the bootloader section. The UART is polled while waiting so nothing the host
+// sends is lost. The received bytes are queued in task_data_arena until the write loop gets to them. It's free since
+// the tasks are stopped and their data is set up again when they're enabled. An erase or write takes about 4.5ms,
+// which is 52 bytes at 115200 baud.
+#define WRITE_RX_LEN 64
+_Static_assert(sizeof(task_data_arena) >= WRITE_RX_LEN, "The task data arena is too small to buffer the UART.");
+_Static_assert((WRITE_RX_LEN & (WRITE_RX_LEN - 1)) == 0, "WRITE_RX_LEN must be a power of 2.");
+
+struct WriteRx {
+	// The number of bytes put in and taken out of the buffer. They wrap around.
+	uint8_t head;
+	uint8_t tail;
 };
 
-void HandleDeleteCmd() {
-	while (USART_Rx_Bytes_Buffered(0) < 1);
-	uint8_t idx = 0;
-	USART_Read(0, &idx, 1);
-	if (idx < MAX_LD_TASKS) {
-		eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), 0);
-		tasks[idx].size = 0;
-		tasks[idx].enabled = 0;
+// Add the byte the UART received, if there is one, to rx. If it's full the byte is dropped, and the page's CRC fails.
+static inline __attribute__((always_inline)) void PollWriteRx(struct WriteRx* rx) {
+	if (UCSR0A & (1<<RXC0)) {
+		uint8_t data = UDR0;
+		if ((uint8_t)(rx->head - rx->tail) < WRITE_RX_LEN) {
+			task_data_arena[rx->head++ % WRITE_RX_LEN] = data;
+		}
+	}
+}
+
+// Wait for the erase or write to finish with the flash readable again, polling the UART into rx if it isn't NULL.
+static inline __attribute__((always_inline)) void WaitFlashPage(struct WriteRx* rx) {
+	while (boot_spm_busy()) {
+		if (rx) {
+			PollWriteRx(rx);
+		}
+	}
+	boot_rww_enable();
+}
+
+// The interrupt vectors are in the RWW section, so the interrupts are disabled until the flash is readable again.
+// These mustn't be inlined into their callers, which are in the RWW section.
+static void __attribute__((noinline)) BOOTLOADER_SECTION EraseFlashPage(uint16_t offset, struct WriteRx* rx) {
+	uint8_t sreg = SREG;
+	cli();
+	boot_page_erase(offset);
+	WaitFlashPage(rx);
+	SREG = sreg;
+}
+
+static void __attribute__((noinline)) BOOTLOADER_SECTION WriteFlashPage(uint16_t offset, const uint8_t* page,
+                                                                        struct WriteRx* rx) {
+	uint8_t sreg = SREG;
+	cli();
+	for (uint8_t i = 0; i < SPM_PAGESIZE; i += 2) {
+		boot_page_fill(offset + i, *(const uint16_t*)(page + i));
 	}
+	boot_page_write(offset);
+	WaitFlashPage(rx);
+	SREG = sreg;
+}
+
+// Take the next byte the host sent. Returns false if there isn't one.
+static bool ReceiveWriteByte(struct WriteRx* rx, uint8_t* data) {
+	if (rx->head == rx->tail) {
+		return false;
+	}
+	*data = task_data_arena[rx->tail++ % WRITE_RX_LEN];
+	return true;
+}
+
+// The pages are received into two buffers in the stacks memory so the next page can be received while the last
+// one is being erased and written.
+#define WRITE_WINDOW 2
+_Static_assert(sizeof(stacks) >= WRITE_WINDOW * SPM_PAGESIZE, "The stacks are too small to buffer the flash pages.");
+
+// The write is given up on if nothing is received for this long while waiting for a page. This is timed with TCNT1
+// alone to keep it cheap, so it has to be less than the 262ms it takes to wrap. It's also less
+// than the host's 1s timeout, so when the host doesn't get a response it knows the kernel isn't reading pages any
+// more and it's safe to send the write again.
+#define WRITE_TIMEOUT_TICKS (200U * TICKS_PER_MS)
+// After giving up, the rest of what the host sends is dropped until the UART has been quiet for this long, so it
+// isn't taken for packets.
+#define WRITE_DRAIN_TICKS (10U * TICKS_PER_MS)
+
+// Compressed pages are decoded with lz.h. The page buffers are also the window for the matches. The host makes
+// sure tokens don't cross pages, and that matches only reach back into the previous page if it was sent, since the
+// buffer of a skipped page isn't written.
+_Static_assert(WRITE_WINDOW * SPM_PAGESIZE == 256, "The LZ window needs the page buffers to be 256 bytes.");
+
+bool HandleDeleteCmd(const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	if (len != 1 || idx >= MAX_LD_TASKS) {
+		return false;
+	}
+	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), 0);
+	tasks[idx].size = 0;
+	tasks[idx].enabled = 0;
+	run_queue_remove(idx);
 	cleanup_task(idx);
+	return true;
+}
+
+// Returns true if the range is page aligned and inside TASK_PGRM_MEM.
+static bool IsValidTaskRange(uint16_t offset, uint16_t size) {
+	uint16_t mem_start = (uint16_t)TASK_PGRM_MEM;
+	return size != 0 && offset % SPM_PAGESIZE == 0 && offset >= mem_start &&
+	       offset - mem_start + size <= TASK_PRGM_MEM_SIZE;
+}
+
+// The CRC of each page in the range is sent back so the host can work out which pages need to be written.
+// The CRC is the same one used for the frames. The last page only covers the bytes in the range.
+// The payload is the offset and size.
+bool HandlePageCrcCmd(uint8_t seq, const uint8_t* payload, uint8_t len) {
+	uint16_t offset = payload[0] | (payload[1] << 8);
+	uint16_t size = payload[2] | (payload[3] << 8);
+	if (len != 4 || !IsValidTaskRange(offset, size)) {
+		return false;
+	}
+	uint8_t num_pages = (size + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+	cmd_frame_begin(&cmd_writer, num_pages * 2, seq, CMD_STATUS_ACK);
+	const uint8_t* addr = (const uint8_t*)offset;
+	for (uint8_t page = 0; page < num_pages; page++) {
+		uint16_t crc = 0xFFFF;
+		for (uint8_t i = 0; i < SPM_PAGESIZE && size > 0; i++, size--) {
+			crc = cmd_frame_crc_update(crc, pgm_read_byte(addr++));
+		}
+		cmd_frame_write(&cmd_writer, &crc, 2);
+	}
+	cmd_frame_end(&cmd_writer);
+	return true;
 }
 
-uint8_t HandleWriteHeader() {
-	// Block until header is received.
-	while (USART_Rx_Bytes_Buffered(0) < 5);
+// Pick where to put a task of the given size, treating the pages of the task it replaces as free.
+// Returns the page index in TASK_PGRM_MEM, or NO_TASK if there's no space.
+// The flash pages only last about 10,000 erases, so the task goes where the most worn page it would use has been
+// erased the least. Ties go to the task's current place so an update only needs to rewrite the changed pages,
+// and then to the least total wear.
+static uint8_t PlaceTask(uint8_t idx, uint16_t size) {
+	uint8_t num_pages = (size + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+	uint16_t mem_start = (uint16_t)TASK_PGRM_MEM;
+	uint16_t used_mask = 0;
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if (i == idx || tasks[i].size == 0) {
+			continue;
+		}
+		uint8_t first = (tasks[i].task_offset - mem_start) / SPM_PAGESIZE;
+		uint8_t count = (tasks[i].size + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+		for (uint8_t page = first; page < first + count; page++) {
+			used_mask |= (uint16_t)1 << page;
+		}
+	}
+	uint8_t current = NO_TASK;
+	if (idx < MAX_LD_TASKS && tasks[idx].size > 0) {
+		current = (tasks[idx].task_offset - mem_start) / SPM_PAGESIZE;
+	}
+	
+	uint16_t counts[TASK_PRGM_MEM_PAGES];
+	eeprom_read_block(counts, eeprom_task_entries.page_erase_counts, sizeof(counts));
 	
+	uint8_t best = NO_TASK;
+	uint16_t best_max = 0;
+	uint32_t best_total = 0;
+	for (uint8_t start = 0; start + num_pages <= TASK_PRGM_MEM_PAGES; start++) {
+		uint16_t max_count = 0;
+		uint32_t total = 0;
+		bool fits = true;
+		for (uint8_t page = start; page < start + num_pages; page++) {
+			if (used_mask & ((uint16_t)1 << page)) {
+				fits = false;
+				break;
+			}
+			if (counts[page] > max_count) {
+				max_count = counts[page];
+			}
+			total += counts[page];
+		}
+		if (!fits) {
+			continue;
+		}
+		if (best == NO_TASK || max_count < best_max ||
+		    (max_count == best_max && best != current && (start == current || total < best_total))) {
+			best = start;
+			best_max = max_count;
+			best_total = total;
+		}
+	}
+	return best;
+}
+
+// Returns true if the data for a task can go at addr without overlapping the data of any task except idx.
+static bool IsTaskDataFree(uint8_t idx, uint16_t addr, uint8_t data_len) {
+	uint16_t arena_start = (uint16_t)task_data_arena;
+	if (addr < arena_start || addr - arena_start + data_len > TASK_DATA_ARENA_SIZE) {
+		return false;
+	}
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if (i == idx || tasks[i].size == 0) {
+			continue;
+		}
+		struct EepromTaskEntry* eprom_ptr = eeprom_task_entries.eeprom_tasks + i;
+		uint16_t start = eeprom_read_word(&(eprom_ptr->data_addr));
+		uint8_t other_len = eeprom_read_byte(&(eprom_ptr->data_size)) + eeprom_read_byte(&(eprom_ptr->bss_size));
+		if (other_len > 0 && data_len > 0 && addr < start + other_len && start < addr + data_len) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Pick where to put the data for a task, treating the data of the task it replaces as free.
+// Returns the address, or 0 if there's no space.
+static uint16_t PlaceTaskData(uint8_t idx, uint8_t data_len) {
+	// The data can go at the start of the arena or right after another task's data.
+	uint16_t addr = (uint16_t)task_data_arena;
+	if (IsTaskDataFree(idx, addr, data_len)) {
+		return addr;
+	}
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if (i == idx || tasks[i].size == 0) {
+			continue;
+		}
+		struct EepromTaskEntry* eprom_ptr = eeprom_task_entries.eeprom_tasks + i;
+		addr = eeprom_read_word(&(eprom_ptr->data_addr)) + eeprom_read_byte(&(eprom_ptr->data_size)) +
+		       eeprom_read_byte(&(eprom_ptr->bss_size));
+		if (IsTaskDataFree(idx, addr, data_len)) {
+			return addr;
+		}
+	}
+	return 0;
+}
+
+// The payload is the task index, size, and the size of its .data and .bss. The task index can be past the last
+// task for a new task.
+// Responds with the offset and data address to load the task with.
+bool HandlePlaceCmd(uint8_t seq, const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	uint16_t size = payload[1] | (payload[2] << 8);
+	uint8_t data_len = payload[3];
+	if (len != 4 || size == 0 || size > TASK_PRGM_MEM_SIZE) {
+		return false;
+	}
+	uint8_t page = PlaceTask(idx, size);
+	uint16_t data_addr = PlaceTaskData(idx, data_len);
+	if (page == NO_TASK || data_addr == 0) {
+		return false;
+	}
+	uint16_t offset = (uint16_t)TASK_PGRM_MEM + page * SPM_PAGESIZE;
+	cmd_frame_begin(&cmd_writer, 4, seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, &offset, 2);
+	cmd_frame_write(&cmd_writer, &data_addr, 2);
+	cmd_frame_end(&cmd_writer);
+	return true;
+}
+
+void HandleEraseCountsCmd(uint8_t seq) {
+	uint16_t counts[TASK_PRGM_MEM_PAGES];
+	eeprom_read_block(counts, eeprom_task_entries.page_erase_counts, sizeof(counts));
+	cmd_frame_begin(&cmd_writer, sizeof(counts), seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, counts, sizeof(counts));
+	cmd_frame_end(&cmd_writer);
+}
+
+// Add one to the erase counts of the pages in mask. Bit i is the page i pages after offset.
+static void AddPageErases(uint16_t offset, uint8_t num_pages, uint16_t mask) {
+	uint8_t first_page = (offset - (uint16_t)TASK_PGRM_MEM) / SPM_PAGESIZE;
+	for (uint8_t i = 0; i < num_pages; i++) {
+		if (mask & ((uint16_t)1 << i)) {
+			uint16_t* count = eeprom_task_entries.page_erase_counts + first_page + i;
+			eeprom_write_word(count, eeprom_read_word(count) + 1);
+		}
+	}
+}
 
-	uint8_t idx = 0;
-	USART_Read(0, &idx, 1);
-	USART_Read(0, &(tasks[idx].task_offset), 2);
-	USART_Read(0, &(tasks[idx].size), 2);
+// Stop all the tasks before the task memory is changed.
+// This isn't strictly necessary, but simplifies some of the cleanup.
+static void StopAllTasks() {
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		tasks[i].enabled = 0;
+		tasks[i].priority = tasks[i].base_priority;
+	}
+	run_queue_init();
+	reset_locks();
+	reset_queues();
+	reset_events();
+}
+
+// The payload is the task index, offset, size, name, priority, a bitmap of the pages the host will send, the
+// number of relocations, the data address, the size of .data and .bss, and the stack size.
+// The name is sent without the terminating 0, so it's at most 15 characters.
+// Bit i of the bitmap is page i of the task. The pages that aren't sent already have the right contents.
+// A stack size of 0 uses STACK_SIZE.
+// The size includes the .data initial values and the relocation table at the end of the task. Each page that's
+// sent is followed by the number of relocations in it, then the relocations, so the page can be patched before it's
+// written. A relocation that starts on the last byte of a page is sent with both pages. Last is the CRC of the
+// bytes sent for the page, in the same format as the frames. If a page's CRC is wrong or the host stops sending, the
+// write is given up on and the kernel responds with CMD_STATUS_NAK. The task is left deleted.
+#define WRITE_HEADER_LEN 30
+#define WRITE_NAME_LEN 15
+_Static_assert(TASK_PRGM_MEM_PAGES <= 16, "The write page bitmap is too small.");
+_Static_assert(2 + WRITE_HEADER_LEN <= CMD_FRAME_MAX_BODY, "The write header doesn't fit in a frame.");
+
+// Returns the index of the task to write, or NO_TASK if the header isn't valid.
+uint8_t HandleWriteHeader(const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	uint16_t task_offset = payload[1] | (payload[2] << 8);
+	uint16_t task_size = payload[3] | (payload[4] << 8);
+	uint16_t reloc_count = payload[23] | (payload[24] << 8);
+	uint16_t data_addr = payload[25] | (payload[26] << 8);
+	uint8_t data_size = payload[27];
+	uint8_t bss_size = payload[28];
+	uint8_t stack_size = payload[29] ? payload[29] : STACK_SIZE;
+	// The task can go over the pages of the task it replaces, but not the other tasks.
+	if (len != WRITE_HEADER_LEN || idx >= MAX_LD_TASKS || !IsValidTaskRange(task_offset, task_size) ||
+	    !task_range_is_free(idx, task_offset, task_size, SPM_PAGESIZE) || reloc_count > task_size / TASK_RELOC_SIZE ||
+	    reloc_count * TASK_RELOC_SIZE + data_size > task_size || data_size + bss_size > TASK_DATA_ARENA_SIZE ||
+	    !IsTaskDataFree(idx, data_addr, data_size + bss_size) || stack_size < MIN_STACK_SIZE ||
+	    stack_size > STACK_ARENA_SIZE) {
+		return NO_TASK;
+	}
+	tasks[idx].task_offset = task_offset;
+	tasks[idx].size = task_size;
+	tasks[idx].stack_size = stack_size;
+	tasks[idx].stack_used = 0;
 	
 	uint8_t i = 0;
-	while(i < 16) {
-		i += USART_Read(0, tasks[idx].name + i, 1);
+	for (i = 0; i < WRITE_NAME_LEN; i++) {
+		tasks[idx].name[i] = payload[5 + i];
 	}
-	
-	// This isn't strictly necessary, but simplifies some of the cleanup.
-	for (i = 0; i < MAX_LD_TASKS; i++) {
-		tasks[i].enabled = 0;
+	tasks[idx].name[WRITE_NAME_LEN] = 0;
+	uint8_t priority = payload[20];
+	if (priority >= NUM_PRIORITIES) {
+		priority = NUM_PRIORITIES - 1;
 	}
-	release_lock();
+	tasks[idx].base_priority = priority;
+	tasks[idx].priority = priority;
+	
+	StopAllTasks();
 	
 	struct EepromTaskEntry* eprom_ptr = eeprom_task_entries.eeprom_tasks + idx;
 	// Set this to 0 in case the write fails.
 	eeprom_write_word(&(eprom_ptr->task_size), 0);
 	eeprom_write_word(&(eprom_ptr->task_offset), tasks[idx].task_offset);
 	eeprom_write_block(tasks[idx].name, eprom_ptr->task_name, 16);
+	eeprom_write_byte(&(eprom_ptr->task_priority), priority);
+	eeprom_write_word(&(eprom_ptr->reloc_count), reloc_count);
+	eeprom_write_word(&(eprom_ptr->data_addr), data_addr);
+	eeprom_write_byte(&(eprom_ptr->data_size), data_size);
+	eeprom_write_byte(&(eprom_ptr->bss_size), bss_size);
+	eeprom_write_byte(&(eprom_ptr->stack_size), stack_size);
 	eeprom_busy_wait();
 	return idx;
 }
 
 
-void BOOTLOADER_SECTION HandleWriteCmd() {
+void HandleWriteCmd(uint8_t seq, const uint8_t* payload, uint8_t len, bool compressed) {
 	
-	// This doesn't need to be in boot section so separate into own function.
-	uint8_t idx = HandleWriteHeader();
+	uint8_t idx = HandleWriteHeader(payload, len);
+	if (idx == NO_TASK) {
+		SendResponse(seq, CMD_STATUS_ERROR);
+		return;
+	}
 	
-	// Since the UART interrupts are in the RWW memory disable them. Ideally, I'd move them to the NRWW section,
-	// but I don't want to do the config to move the vector table.
-	cli();
+	// The UART is polled while receiving the pages, so its interrupts would take the bytes. The other interrupts are
+	// left on so get_time doesn't lose timer1 overflows. They're only off while a page is erased or written.
+	uint8_t uart_control = UCSR0B;
+	UCSR0B = uart_control & ~((1<<RXCIE0) | (1<<UDRIE0));
 	
 	uint16_t task_size = tasks[idx].size;
 	uint16_t task_offset = tasks[idx].task_offset;
-
+	uint8_t num_pages = (task_size + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+	uint16_t send_mask = payload[21] | (payload[22] << 8);
+	uint16_t data_addr = payload[25] | (payload[26] << 8);
+	// The number of pages erased and written, reported back to the host.
+	uint8_t pages_written = 0;
+	// Bit i is set if page i of the task was erased. The erase counts are updated once the write is done.
+	uint16_t erased_mask = 0;
 	
-	// I found the instructions in the datasheet a little unclear about when writing to the flash buffer is allowed.
-	// My understanding is that you can write at any time, but doing the flash write clears it.
+	struct LzDecoder lz = {0, 0, 0};
+	struct WriteRx rx = {0, 0};
 	
-	// At 115200 baud 128 bytes transfer in about 11ms. The flash erase and write supposed
-	// to be about 4ms each. Ideally I should be able to receive and write the bytes to
-	// the temporary buffer while these operations are going.
-
+	// The relocations for the page being received.
+	bool have_reloc_count = false;
+	uint8_t relocs_left = 0;
+	uint8_t reloc[TASK_RELOC_SIZE];
+	uint8_t reloc_pos = 0;
+	// The CRC of the bytes received for the page. The CRC the host sent is XORed in after it, so it ends up 0 if
+	// they match.
+	uint16_t page_crc = 0xFFFF;
+	uint8_t crc_pos = 0;
+	// The last time a byte was received or a page request was sent, for WRITE_TIMEOUT_TICKS.
+	uint16_t last_rx_ticks = TCNT1;
+	bool failed = false;
 	
-	// I'm assuming the start offset falls on a page boundary and is a multiple of 2 bytes large.
-	while (task_size > 0) {
-/*
-		uint8_t word[2];
-		boot_spm_busy_wait();
-		boot_page_erase (task_offset);
-		boot_spm_busy_wait();
-		
-		// Send the offset to sync the writes from the host
-		WRITE_UART_BYTE(task_offset & 0xFF);
-		WRITE_UART_BYTE(task_offset >> 8);
-		
-		for (int i = 0; i<SPM_PAGESIZE && task_size > 0; i +=2 ) {
-			READ_UART_BYTE(word[0]);
-			READ_UART_BYTE(word[1]);
-			task_size-=2;
-			boot_page_fill (task_offset + i, *(uint16_t*)word);
+	// At 115200 baud 128 bytes transfer in about 11ms. The flash erase and write are supposed to be about 4ms
+	// each. Waiting for each page before requesting the next one also adds the host's latency to every page.
+	// Instead, the host is allowed to send up to WRITE_WINDOW pages ahead. Each page is requested with its offset
+	// once there's a free buffer for it, so the host always has the next request before it finishes sending a page.
+	//
+	// The loop does these in parallel:
+	// * Send the queued page request a byte at a time. Waiting for the whole frame would drop received bytes.
+	// * Receive bytes from the UART into the buffer for the page being received, decompressing them if needed.
+	//   Each match byte is copied in its own pass through the loop so the UART is still checked.
+	//   Then receive the page's relocations and patch them into the buffer, then check the page's CRC.
+	// * Erase the flash for the oldest received page, then write it. The buffer is free for the next request once
+	//   it's written.
+	// The pages that aren't in send_mask are never requested, and go through each step without any data. Pages that
+	// are sent but already match the flash are also skipped to save the erase and write.
+	// The page counts are in order: pages_programmed <= pages_received <= pages_requested.
+	uint8_t pages_requested = 0;
+	uint8_t pages_received = 0;
+	uint8_t pages_programmed = 0;
+	uint8_t rx_pos = 0;
+	
+	uint8_t tx_buffer[PAGE_REQUEST_MAX_LEN];
+	uint8_t tx_len = 0;
+	uint8_t tx_pos = 0;
+	
+	while (pages_programmed < num_pages || tx_pos < tx_len) {
+		// Every received byte goes through rx, so the UART is checked on every pass even while a match is copied.
+		PollWriteRx(&rx);
+		if (tx_pos < tx_len) {
+			if (UCSR0A & (1<<UDRE0)) {
+				UDR0 = tx_buffer[tx_pos++];
+				// The host can't start on the page until it has the whole request.
+				last_rx_ticks = TCNT1;
+			}
+		} else if (pages_requested < num_pages && pages_requested < pages_programmed + WRITE_WINDOW) {
+			if (send_mask & ((uint16_t)1 << pages_requested)) {
+				tx_len = QueuePageRequest(tx_buffer, seq, task_offset + pages_requested * SPM_PAGESIZE);
+				tx_pos = 0;
+			}
+			pages_requested++;
 		}
 		
-		boot_page_write (task_offset);
-		task_offset += SPM_PAGESIZE;
-*/
-		// Send the offset to sync the writes from the host
-		WRITE_UART_BYTE(task_offset & 0xFF);
-		WRITE_UART_BYTE(task_offset >> 8);
-		// This loop is trying to do a few things in parallel:
-		// * Wait for the previous write to finish and erase the next page when ready.
-		//   The first time this is called no write is in progress so this should occur immediately.
-		// * Receive bytes from the UART to write.
-		// * Write the received bytes to the temporary buffer.
-		int i = 0;
-		enum SpmState state = SPM_STATE_WRITING;
-		while (true) {
-			// Check if the Flash is free to erase.
-			if (state == SPM_STATE_WRITING && !boot_spm_busy()) {
-				boot_page_erase (task_offset);
-				state = SPM_STATE_ERASING;
-			// The erase finished.
-			} else if (state == SPM_STATE_ERASING && !boot_spm_busy()) {
-				state = SPM_READY;
-			}
-			
-			if (i<SPM_PAGESIZE && task_size > 0) {
-				// Check if a new UART byte was received.
-				// If it's the second byte in the word, write it to the temp buffer.
-				if (UCSR0A & (1<<RXC0)) {
-					stacks[i] = UDR0;
-					i++;
-					task_size--;
+		// Only pages that were requested are received. The host shouldn't send anything else.
+		if (pages_received < pages_requested && !(send_mask & ((uint16_t)1 << pages_received))) {
+			pages_received++;
+		} else if (pages_received < pages_requested) {
+			uint8_t* buffer = stacks + (pages_received % WRITE_WINDOW) * SPM_PAGESIZE;
+			uint8_t buffer_pos = (pages_received % WRITE_WINDOW) * SPM_PAGESIZE + rx_pos;
+			uint16_t page_start = pages_received * SPM_PAGESIZE;
+			uint8_t page_len = task_size - page_start < SPM_PAGESIZE ? task_size - page_start : SPM_PAGESIZE;
+			bool have_byte = false;
+			// Set for the bytes that are covered by the page's CRC.
+			bool received = false;
+			uint8_t data = 0;
+			if (rx_pos == page_len) {
+				if (ReceiveWriteByte(&rx, &data)) {
+					last_rx_ticks = TCNT1;
+					if (!have_reloc_count) {
+						relocs_left = data;
+						have_reloc_count = true;
+						received = true;
+					} else if (relocs_left > 0) {
+						reloc[reloc_pos++] = data;
+						received = true;
+					} else {
+						page_crc ^= (uint16_t)data << (crc_pos * 8);
+						crc_pos++;
+					}
+				}
+				if (reloc_pos == TASK_RELOC_SIZE) {
+					reloc_apply_page(buffer, page_start, SPM_PAGESIZE, reloc[0] | (reloc[1] << 8), reloc[2],
+					                 reloc[3] | (reloc[4] << 8), task_offset, data_addr);
+					reloc_pos = 0;
+					relocs_left--;
 				}
-			} else if (state == SPM_READY) {
+				if (crc_pos == 2) {
+					if (page_crc != 0) {
+						failed = true;
+						break;
+					}
+					pages_received++;
+					rx_pos = 0;
+					have_reloc_count = false;
+					page_crc = 0xFFFF;
+					crc_pos = 0;
+				}
+			} else if (lz_decode_copying(&lz)) {
+				data = lz_decode_copy(&lz, stacks, buffer_pos);
+				have_byte = true;
+			} else if (ReceiveWriteByte(&rx, &data)) {
+				last_rx_ticks = TCNT1;
+				received = true;
+				have_byte = !compressed || lz_decode_input(&lz, data);
+			}
+			if (have_byte) {
+				stacks[buffer_pos] = data;
+				rx_pos++;
+			}
+			if (received) {
+				page_crc = cmd_frame_crc_update(page_crc, data);
+			} else if ((uint16_t)(TCNT1 - last_rx_ticks) > WRITE_TIMEOUT_TICKS) {
+				failed = true;
 				break;
 			}
 		}
-
-		for (i = 0; i<SPM_PAGESIZE; i +=2 ) {
-			boot_page_fill (task_offset + i, *(uint16_t*)(stacks + i));
-		}
 		
-		// With the full page in the temporary buffer, write it to flash.
-		boot_page_write (task_offset);
-		task_offset += SPM_PAGESIZE;
+		// The flash is only erased or written once the bytes received during the last erase or write have been
+		// handled, so there's space for the ones received during this one. The page request is sent first so the
+		// host isn't kept waiting for it.
+		if (pages_programmed < pages_received && rx.head == rx.tail && tx_pos == tx_len) {
+			uint16_t page_offset = task_offset + pages_programmed * SPM_PAGESIZE;
+			uint8_t* page = stacks + (pages_programmed % WRITE_WINDOW) * SPM_PAGESIZE;
+			uint16_t page_bit = (uint16_t)1 << pages_programmed;
+			if (erased_mask & page_bit) {
+				WriteFlashPage(page_offset, page, &rx);
+				pages_programmed++;
+				pages_written++;
+			} else {
+				bool changed = false;
+				if (send_mask & page_bit) {
+					// Only compare the bytes that are part of the task.
+					uint16_t page_len = task_size - pages_programmed * SPM_PAGESIZE;
+					if (page_len > SPM_PAGESIZE) {
+						page_len = SPM_PAGESIZE;
+					}
+					for (uint8_t i = 0; i < page_len && !changed; i++) {
+						changed = page[i] != pgm_read_byte((const uint8_t*)page_offset + i);
+					}
+				}
+				if (changed) {
+					EraseFlashPage(page_offset, &rx);
+					erased_mask |= page_bit;
+				} else {
+					pages_programmed++;
+				}
+			}
+		}
+	}
+	
+	if (failed) {
+		// Finish the page request being sent so the host can find the frame after it. Then drop the rest of the
+		// pages the host already sent.
+		while (tx_pos < tx_len) {
+			WRITE_UART_BYTE(tx_buffer[tx_pos++]);
+		}
+		uint16_t quiet_start = TCNT1;
+		while ((uint16_t)(TCNT1 - quiet_start) < WRITE_DRAIN_TICKS) {
+			if (UCSR0A & (1<<RXC0)) {
+				(void)UDR0;
+				quiet_start = TCNT1;
+			}
+		}
 	}
 	
-	boot_spm_busy_wait();       // Wait until the memory is written.
+	UCSR0B = uart_control;
+	
+	AddPageErases(task_offset, num_pages, erased_mask);
+	if (failed) {
+		tasks[idx].size = 0;
+		SendResponse(seq, CMD_STATUS_NAK);
+		return;
+	}
+	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), tasks[idx].size);
+	cmd_frame_begin(&cmd_writer, 1, seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, &pages_written, 1);
+	cmd_frame_end(&cmd_writer);
+}
 
-	// Reenable RWW-section again. We need this if we want to jump back
-	// to the application after bootloading.
 
-	boot_rww_enable ();
+// The payload is the task index and the offset to move it to.
+// Returns the index of the task to move, or NO_TASK if it can't be moved there.
+uint8_t HandleMoveHeader(const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	uint16_t new_offset = payload[1] | (payload[2] << 8);
+	if (len != 3 || idx >= MAX_LD_TASKS || tasks[idx].size == 0 || !IsValidTaskRange(new_offset, tasks[idx].size)) {
+		return NO_TASK;
+	}
+	uint16_t old_offset = tasks[idx].task_offset;
+	// The pages are copied from the start, so moving up over itself would overwrite pages before they're copied.
+	if (new_offset > old_offset && new_offset < old_offset + tasks[idx].size) {
+		return NO_TASK;
+	}
+	if (!task_range_is_free(idx, new_offset, tasks[idx].size, SPM_PAGESIZE)) {
+		return NO_TASK;
+	}
+	// HandleMoveCmd finds the code size from this, which mustn't wrap.
+	uint16_t reloc_count = eeprom_read_word(&(eeprom_task_entries.eeprom_tasks[idx].reloc_count));
+	if (reloc_count > tasks[idx].size / TASK_RELOC_SIZE) {
+		return NO_TASK;
+	}
+	StopAllTasks();
+	return idx;
+}
+
+// Move a task to another place in flash to make space for bigger tasks. The addresses in the task are patched using
+// its relocation table.
+void HandleMoveCmd(uint8_t seq, const uint8_t* payload, uint8_t len) {
+	uint8_t idx = HandleMoveHeader(payload, len);
+	if (idx == NO_TASK) {
+		SendResponse(seq, CMD_STATUS_ERROR);
+		return;
+	}
+	uint16_t new_offset = payload[1] | (payload[2] << 8);
+	uint16_t old_offset = tasks[idx].task_offset;
+	uint16_t task_size = tasks[idx].size;
+	uint8_t num_pages = (task_size + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+	uint16_t reloc_count = eeprom_read_word(&(eeprom_task_entries.eeprom_tasks[idx].reloc_count));
+	uint16_t data_addr = eeprom_read_word(&(eeprom_task_entries.eeprom_tasks[idx].data_addr));
+	// The size of the code and .data initial values, which are what the relocations patch.
+	uint16_t code_size = task_size - reloc_count * TASK_RELOC_SIZE;
+	// The task is invalid until the move finishes.
+	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), 0);
+	eeprom_busy_wait();
 	
-	sei();
+	// When the task moves down over itself, writing page i only overwrites the pages before page i of the old copy.
+	// The relocation table is at the end, so it's still intact while the pages before it are patched.
+	for (uint8_t page = 0; page < num_pages; page++) {
+		uint16_t page_start = page * SPM_PAGESIZE;
+		for (uint8_t i = 0; i < SPM_PAGESIZE; i++) {
+			stacks[i] = pgm_read_byte((const uint8_t*)old_offset + page_start + i);
+		}
+		for (uint16_t r = 0; r < reloc_count && page_start < code_size; r++) {
+			const uint8_t* entry = (const uint8_t*)old_offset + code_size + r * TASK_RELOC_SIZE;
+			reloc_apply_page(stacks, page_start, SPM_PAGESIZE, pgm_read_word(entry), pgm_read_byte(entry + 2),
+			                 pgm_read_word(entry + 3), new_offset, data_addr);
+		}
+		
+		EraseFlashPage(new_offset + page_start, NULL);
+		WriteFlashPage(new_offset + page_start, stacks, NULL);
+	}
 	
-	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), tasks[idx].size);
+	tasks[idx].task_offset = new_offset;
+	AddPageErases(new_offset, num_pages, 0xFFFF);
+	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_offset), new_offset);
+	eeprom_write_word(&(eeprom_task_entries.eeprom_tasks[idx].task_size), task_size);
+	SendResponse(seq, CMD_STATUS_ACK);
 }
 
+// Copy the initial values of the task's .data from flash and clear its .bss.
+void init_task_data(uint8_t idx) {
+	struct EepromTaskEntry* eprom_ptr = eeprom_task_entries.eeprom_tasks + idx;
+	uint8_t* data = (uint8_t*)eeprom_read_word(&(eprom_ptr->data_addr));
+	uint8_t data_size = eeprom_read_byte(&(eprom_ptr->data_size));
+	uint8_t bss_size = eeprom_read_byte(&(eprom_ptr->bss_size));
+	uint16_t relocs_size = eeprom_read_word(&(eprom_ptr->reloc_count)) * TASK_RELOC_SIZE;
+	const uint8_t* data_init = (const uint8_t*)(tasks[idx].task_offset + tasks[idx].size - relocs_size - data_size);
+	memcpy_P(data, data_init, data_size);
+	memset(data + data_size, 0, bss_size);
+}
 
-void HandleEnableCmd() {
-	while(USART_Rx_Bytes_Buffered(0) < 2);
-	uint8_t idx = 0;
-	USART_Read(0, &idx, 1);
-	uint8_t is_enabled = 0;
-	USART_Read(0, &is_enabled, 1);
-	if (idx < MAX_LD_TASKS) {
-		if (!tasks[idx].enabled && is_enabled) {
-			if (tasks[idx].size == 0) {
-				return;
-			}
-			USART_Rx_Clear(idx + 1);
-			setup_start_func(idx);
-			tasks[idx].next_run = get_time();
-		} else if (!is_enabled) {
-			cleanup_task(idx);
+bool HandleEnableCmd(const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	uint8_t is_enabled = payload[1];
+	if (len != 2 || idx >= MAX_LD_TASKS) {
+		return false;
+	}
+	if (!tasks[idx].enabled && is_enabled) {
+		if (tasks[idx].size == 0) {
+			return false;
 		}
-		tasks[idx].enabled = is_enabled;
+		tasks[idx].stack_start = AllocTaskStack(idx);
+		if (tasks[idx].stack_start == NULL) {
+			return false;
+		}
+		tasks[idx].fault = TASK_FAULT_NONE;
+		STATS_RESET(idx);
+		USART_Rx_Clear(idx + 1);
+		init_task_data(idx);
+		setup_start_func(idx);
+		tasks[idx].next_run = get_time();
+		run_queue_sleep(idx);
+	} else if (!is_enabled) {
+		run_queue_remove(idx);
+		cleanup_task(idx);
 	}
+	tasks[idx].enabled = is_enabled;
+	return true;
 }
 
-void check_scheduler_cmds() {
-	uint8_t cmd_type = 0;
-	bool found = false;
-	// This makes the big assumption that the serial input synced and stays synced.
-	while (USART_Read(0, &cmd_type, 1)) {
-		switch (cmd_type) {
-			case CMD_LIST:
-				found = true;
-				HandleListTasksCmd();
-				break;
-			case CMD_ENABLE:
-				found = true;
-				HandleEnableCmd();
-				break;
-			case CMD_WRITE:
-				found = true;
-				HandleWriteCmd();
-				break;
-			case CMD_DELETE:
-				found = true;
-				HandleDeleteCmd();
-				break;
+bool HandlePriorityCmd(const uint8_t* payload, uint8_t len) {
+	uint8_t idx = payload[0];
+	uint8_t priority = payload[1];
+	if (len != 2 || idx >= MAX_LD_TASKS || priority >= NUM_PRIORITIES) {
+		return false;
+	}
+	set_task_priority(idx, priority);
+	eeprom_update_byte(&(eeprom_task_entries.eeprom_tasks[idx].task_priority), priority);
+	return true;
+}
+
+#ifdef TRACE
+// Responds with the current get_time, the number of records dropped since the last drain, and the records, oldest
+// first.
+void HandleTraceCmd(uint8_t seq) {
+	_Static_assert(5 + TRACE_DEPTH * sizeof(struct TraceRecord) <= 253, "TRACE_DEPTH is too big for the response.");
+	uint8_t dropped;
+	uint8_t count = trace_drain_begin(&dropped);
+	uint32_t now = get_time();
+	cmd_frame_begin(&cmd_writer, 5 + count * sizeof(struct TraceRecord), seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, &now, 4);
+	cmd_frame_write(&cmd_writer, &dropped, 1);
+	struct TraceRecord record;
+	while (count > 0 && trace_pop(&record)) {
+		cmd_frame_write(&cmd_writer, &record, sizeof(record));
+		count--;
+	}
+	cmd_frame_end(&cmd_writer);
+	trace_drain_end();
+}
+#endif
+
+#ifdef TASK_STATS
+// Responds with STATS_VERSION, the current get_time, the time spent idle, the number of tasks, the size of each
+// task's entry, then a struct TaskStats for each task. The host can skip fields it doesn't know about at the end of
+// each entry, so fields can be added without breaking older clients.
+void HandleStatsCmd(uint8_t seq) {
+	_Static_assert(11 + MAX_LD_TASKS * sizeof(struct TaskStats) <= 253, "Too many tasks for the stats response.");
+	uint8_t header[11];
+	header[0] = STATS_VERSION;
+	*(uint32_t*)(header + 1) = get_time();
+	*(uint32_t*)(header + 5) = stats_get_idle();
+	header[9] = MAX_LD_TASKS;
+	header[10] = sizeof(struct TaskStats);
+	cmd_frame_begin(&cmd_writer, 11 + MAX_LD_TASKS * sizeof(struct TaskStats), seq, CMD_STATUS_ACK);
+	cmd_frame_write(&cmd_writer, header, 11);
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		cmd_frame_write(&cmd_writer, stats_get(i), sizeof(struct TaskStats));
+	}
+	cmd_frame_end(&cmd_writer);
+}
+#endif
+
+void RunCmd(uint8_t seq, uint8_t cmd_type, const uint8_t* payload, uint8_t len, uint16_t crc) {
+	bool resent = seq == cmd_last_seq && crc == cmd_last_crc;
+	cmd_last_seq = seq;
+	cmd_last_crc = crc;
+	// The commands that only read the state don't change anything, and writing has its own handshake, so these are
+	// always run.
+	if (cmd_type == CMD_LIST) {
+		HandleListTasksCmd(seq);
+		return;
+	} else if (cmd_type == CMD_WRITE || cmd_type == CMD_WRITE_LZ) {
+		HandleWriteCmd(seq, payload, len, cmd_type == CMD_WRITE_LZ);
+		return;
+	} else if (cmd_type == CMD_PAGE_CRC) {
+		if (!HandlePageCrcCmd(seq, payload, len)) {
+			SendResponse(seq, CMD_STATUS_ERROR);
 		}
+		return;
+	} else if (cmd_type == CMD_MOVE) {
+		// Moving the task again would do nothing if it already moved, but would wear the flash.
+		if (resent) {
+			SendResponse(seq, CMD_STATUS_ACK);
+		} else {
+			HandleMoveCmd(seq, payload, len);
+		}
+		return;
+	} else if (cmd_type == CMD_PLACE) {
+		if (!HandlePlaceCmd(seq, payload, len)) {
+			SendResponse(seq, CMD_STATUS_ERROR);
+		}
+		return;
+	} else if (cmd_type == CMD_ERASE_COUNTS) {
+		HandleEraseCountsCmd(seq);
+		return;
+	} else if (cmd_type == CMD_STATS) {
+#ifdef TASK_STATS
+		HandleStatsCmd(seq);
+#else
+		SendResponse(seq, CMD_STATUS_ERROR);
+#endif
+		return;
+	} else if (cmd_type == CMD_TRACE) {
+		// If the response is lost the records in it are gone either way, but draining again means the host still
+		// gets a full response.
+#ifdef TRACE
+		HandleTraceCmd(seq);
+#else
+		SendResponse(seq, CMD_STATUS_ERROR);
+#endif
+		return;
+	} else if (resent) {
+		SendResponse(seq, CMD_STATUS_ACK);
+		return;
+	}
+	
+	bool success = false;
+	switch (cmd_type) {
+		case CMD_ENABLE:
+			success = HandleEnableCmd(payload, len);
+			break;
+		case CMD_DELETE:
+			success = HandleDeleteCmd(payload, len);
+			break;
+		case CMD_PRIORITY:
+			success = HandlePriorityCmd(payload, len);
+			break;
+	}
+	SendResponse(seq, success ? CMD_STATUS_ACK : CMD_STATUS_ERROR);
+}
 
-		if (found) {
-			for(uint8_t i = 1; i < MAX_TASKS; i++) {
-				USART_Rx_Clear(i);
-			}
+void check_scheduler_cmds() {
+	// Drop a partial frame if the rest of it never arrived so it doesn't swallow the next command.
+	if (cmd_frame_in_progress(&cmd_parser) && is_time_past(cmd_last_rx_time + CMD_FRAME_TIMEOUT)) {
+		cmd_frame_reset(&cmd_parser);
+	}
+	uint8_t data = 0;
+	while (USART_Read(0, &data, 1)) {
+		cmd_last_rx_time = get_time();
+		enum CmdFrameResult result = cmd_frame_push(&cmd_parser, data);
+		if (result == CMD_FRAME_ERROR) {
+			// Anything else that's buffered is probably the rest of the bad frame. The host will resend it.
+			USART_Rx_Clear(0);
+			SendResponse(0, CMD_STATUS_NAK);
+		} else if (result == CMD_FRAME_READY) {
+			// The body is the sequence number, command type, then the payload.
+			RunCmd(cmd_parser.body[0], cmd_parser.body[1], cmd_parser.body + 2, cmd_parser.len - 2, cmd_parser.crc);
 		}
 	}
 }
@@ -311,6 +1041,9 @@ void init_from_eeprom() {
 		for (uint8_t i = 0; i < sizeof(eeprom_task_entries.eeprom_tasks); i++) {
 			eeprom_write_byte (((uint8_t*)&(eeprom_task_entries.eeprom_tasks)) + i, 0);
 		}
+		for (uint8_t i = 0; i < TASK_PRGM_MEM_PAGES; i++) {
+			eeprom_write_word(eeprom_task_entries.page_erase_counts + i, 0);
+		}
 		eeprom_write_word(&(eeprom_task_entries.eeprom_preample), EEMPROM_PREAMBLE);
 	}
 	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
@@ -320,10 +1053,66 @@ void init_from_eeprom() {
 		if (tasks[i].size > 0) {
 			eeprom_read_block(tasks[i].name, eprom_ptr->task_name, 16);
 			tasks[i].task_offset = eeprom_read_word(&(eprom_ptr->task_offset));
+			tasks[i].base_priority = eeprom_read_byte(&(eprom_ptr->task_priority));
+			tasks[i].priority = tasks[i].base_priority;
+			tasks[i].stack_size = eeprom_read_byte(&(eprom_ptr->stack_size));
 		}
 	}
 }
 
+void fault_task(uint8_t idx, uint8_t fault) {
+	tasks[idx].enabled = 0;
+	tasks[idx].fault = fault;
+	run_queue_remove(idx);
+	cleanup_task(idx);
+	uint8_t payload[2] = {idx, fault};
+	cmd_frame_begin(&cmd_writer, 2, 0, CMD_STATUS_FAULT);
+	cmd_frame_write(&cmd_writer, payload, 2);
+	cmd_frame_end(&cmd_writer);
+}
+
+// The compare match is only used to wake the MCU from sleep. The main loop does the actual scheduling.
+EMPTY_INTERRUPT(TIMER1_COMPA_vect);
+
+// Sleep until the next task is due or an interrupt (like UART RX) fires.
+// Timer1 keeps running in idle mode, so OCR1A is set to the wake up time of the first sleeping task.
+void idle_until_next_event() {
+	uint32_t wake_time;
+	// Interrupts stay disabled until the sleep instruction so a wake up can't be missed between the
+	// checks and going to sleep. Any interrupt that becomes pending will wake the MCU right away.
+	cli();
+	if (run_queue_next_wake(&wake_time)) {
+		// Writing OCR1A blocks a compare match on the next timer clock, so don't rely on the interrupt
+		// for wake ups that are about to happen anyway.
+		if ((int32_t)(wake_time - get_time()) <= 1) {
+			sei();
+			return;
+		}
+		// Only the low 16 bits are compared. If the wake up is more than a timer period away, this
+		// wakes up early and goes back to sleep.
+		OCR1A = wake_time;
+		// Clear any stale match from an earlier wake up before enabling the interrupt.
+		TIFR1 = 1 << OCF1A;
+		TIMSK1 |= 1 << OCIE1A;
+	} else {
+		TIMSK1 &= ~(1 << OCIE1A);
+	}
+	// A command may have arrived after check_scheduler_cmds ran, or data may have arrived for a task.
+	if (USART_Rx_Bytes_Buffered(0) > 0 || USART_Rx_Event_Pending()) {
+		sei();
+		return;
+	}
+#ifdef TASK_STATS
+	uint32_t idle_start = get_time();
+#endif
+	sleep_enable();
+	// The instruction after sei is always executed before any pending interrupt.
+	sei();
+	sleep_cpu();
+	sleep_disable();
+	STATS_ADD_IDLE(get_time() - idle_start);
+}
+
 int main(void)
 {
 	init_from_eeprom();
@@ -334,6 +1123,18 @@ int main(void)
 	// Enable timer1 in normal mode with 4us rate.
 	// To do this, just set the clock source to the 1/64 prescaler.
 	TCCR1B = (1 << CS11) | (1 << CS10);
+	// The overflow interrupt extends the timer to 32 bits.
+	TIMSK1 = 1 << TOIE1;
+	
+#ifdef PREEMPTIVE
+	// Timer0 in CTC mode with the 1/64 prescaler and a period of 250 gives a 1ms tick for time slicing.
+	TCCR0A = 1 << WGM01;
+	TCCR0B = (1 << CS01) | (1 << CS00);
+	OCR0A = 249;
+#endif
+	
+	// Idle mode keeps timer1 and the UART running so either can wake up the scheduler.
+	set_sleep_mode(SLEEP_MODE_IDLE);
 	
 	// Initialize the UART at 115200 baud.
 	USART_Init(115200);
@@ -352,15 +1153,15 @@ int main(void)
 	}
 	*/
 
+	run_queue_init();
+
 	while (1)
 	{
-		current_task = tasks + task_idx;
-		if (current_task->enabled && is_time_past(current_task->next_run)) {
-			// This switches to the stack for the current_task. Execution won't return here until that
-			// task calls suspend_task.
-			start_task();	
-		}
+		dispatch_next();
 		check_scheduler_cmds();
-		task_idx = (task_idx + 1) % MAX_LD_TASKS;
+		// Rather than spinning on get_time, sleep if there's nothing to do.
+		if (!run_queue_has_ready()) {
+			idle_until_next_event();
+		}
 	}
 }
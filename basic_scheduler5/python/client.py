@@ -4,46 +4,197 @@ from faulthandler import is_enabled
 import sys
 import os
 import math
+import random
 import struct
 import subprocess
 import threading
+import time
+import binascii
+import json
 from attr import fields
 
 from colorama import init, Fore, Back, Style
 from serial import Serial
 from serial.tools import list_ports
 
-# // This is what's needed to specify a task.
+# CMD_LIST sends struct Task from syscalls.h for each task, so task_struct_format has to match it.
 # struct Task {
-# 	// All the state is on the stack with it's end at this pointer.
 # 	uint8_t* stack_pointer;
-# 	// This is used to point to the function for the task to start at.
 # 	uint16_t task_offset;
-# 	// This is used to schedule when the task will run next.
-# 	uint16_t next_run;
+# 	uint32_t next_run;
 # 	char name[16];
 # 	uint16_t size;
 # 	bool enabled;
+# 	uint8_t priority;
+# 	uint8_t base_priority;
+# 	uint8_t* stack_start;
+# 	uint8_t stack_size;
+# 	uint8_t stack_used;
+# 	uint8_t fault;
 # };
 list_header_format = '<BHH'
 list_header_size = struct.calcsize(list_header_format)
-task_struct_format = '<HHH16sH?'
+task_struct_format = '<HHI16sH?BBHBBB'
 task_struct_size = struct.calcsize(task_struct_format)
 
-write_header_format = '<BBHH16s'
+# The name is sent without its terminating 0 so the header fits in a frame with the sequence number and command.
+write_header_format = '<BHH15sBHHHBBB'
 
-enable_header_format = '<BBB'
+page_crc_header_format = '<HH'
 
-del_header_format = '<BB'
+place_header_format = '<BHB'
+
+move_header_format = '<BH'
+
+enable_header_format = '<BB'
+
+del_header_format = '<B'
+
+priority_header_format = '<BB'
 
 LIST_CMD = 1
 ENABLE_CMD = 2
 WRITE_CMD = 3
 DELETE_CMD = 4
+PRIORITY_CMD = 5
+PAGE_CRC_CMD = 6
+WRITE_LZ_CMD = 7
+PLACE_CMD = 8
+ERASE_COUNTS_CMD = 9
+MOVE_CMD = 10
+TRACE_CMD = 11
+STATS_CMD = 12
 
 PAGE_SIZE = 128
 
-tool_path = 'C:/Program Files (x86)/Atmel/Studio/7.0/toolchain/avr8/avr8-gnu-toolchain/bin/'
+# The trace drain response is the current time, the number of records dropped, then records of type, arg, and the
+# low 16 bits of the time. See trace.h.
+trace_header_format = '<IB'
+trace_header_size = struct.calcsize(trace_header_format)
+trace_record_format = '<BBH'
+trace_record_size = struct.calcsize(trace_record_format)
+TRACE_SWITCH_IN = 1
+TRACE_SWITCH_OUT = 2
+TRACE_PREEMPT = 3
+TRACE_WAKE = 4
+TRACE_LOCK_ACQUIRE = 5
+TRACE_LOCK_WAIT = 6
+TRACE_LOCK_RELEASE = 7
+TRACE_UART_RX = 8
+TRACE_UART_TX_DONE = 9
+TRACE_LOCK_NAMES = {
+    TRACE_LOCK_ACQUIRE: 'acquire',
+    TRACE_LOCK_WAIT: 'wait',
+    TRACE_LOCK_RELEASE: 'release',
+}
+# Timer1 ticks are 4us.
+US_PER_TICK = 4
+
+# The stats response is the version, current time, idle time, number of tasks, and size of each task's entry. Newer
+# kernels may add fields to the end of the entries. See stats.h.
+stats_header_format = '<BIIBB'
+stats_header_size = struct.calcsize(stats_header_format)
+STATS_VERSION = 1
+task_stats_format = '<IIHIH'
+task_stats_size = struct.calcsize(task_stats_format)
+
+# The format of the compressed pages for WRITE_LZ_CMD. See main.c for the details.
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x7F + LZ_MIN_MATCH
+LZ_MAX_LITERALS = 0x80
+LZ_MAX_DIST = 255
+
+# Data sent to the device is framed like SLIP with the first byte of each packet giving the receive channel.
+# Channel 0 is for the kernel commands, and channel i + 1 is for task i.
+SLIP_END = 0xC0
+SLIP_ESC = 0xDB
+SLIP_ESC_END = 0xDC
+SLIP_ESC_ESC = 0xDD
+
+KERNEL_CHANNEL = 0
+
+# The kernel commands are sent in frames of: length, sequence number, command, payload..., CRC16.
+# The length counts the sequence number, command and payload. The responses use the same format with a status
+# instead of the command, and are SLIP framed so they can be picked out from the task output.
+CMD_FRAME_MAX_BODY = 32
+
+STATUS_ACK = 0
+STATUS_NAK = 1
+STATUS_ERROR = 2
+STATUS_PAGE = 3
+# Sent by the kernel when it stops a task. The payload is the task index and one of FAULT_NAMES.
+STATUS_FAULT = 4
+
+FAULT_NAMES = {
+    1: 'stack overflow',
+}
+
+CMD_RETRIES = 3
+
+# Tasks are linked at address 0 and the kernel patches the absolute addresses for where they're loaded. A task image
+# is the code, the initial values of .data, then a table of the addresses to patch. See reloc.h.
+IMAGE_MAGIC = b'TSK2'
+# Magic, code size, number of relocations, .data size, .bss size.
+image_header_format = '<4sHHBB'
+image_header_size = struct.calcsize(image_header_format)
+# Offset of the word to patch, type, and the linked address.
+reloc_format = '<HBH'
+reloc_size = struct.calcsize(reloc_format)
+
+RELOC_WORD = 0
+RELOC_WORD_PM = 1
+RELOC_LDI_LO = 2
+RELOC_LDI_HI = 3
+RELOC_LDI_PM_LO = 4
+RELOC_LDI_PM_HI = 5
+RELOC_DATA_WORD = 6
+RELOC_DATA_LDI_LO = 7
+RELOC_DATA_LDI_HI = 8
+# Added to the ldi types for the negated address used by subi and sbci.
+RELOC_NEG = 0x80
+
+ELF_RELOC_TYPES = {
+    'R_AVR_16': RELOC_WORD,
+    'R_AVR_16_PM': RELOC_WORD_PM,
+    'R_AVR_LO8_LDI': RELOC_LDI_LO,
+    'R_AVR_HI8_LDI': RELOC_LDI_HI,
+    'R_AVR_LO8_LDI_PM': RELOC_LDI_PM_LO,
+    'R_AVR_HI8_LDI_PM': RELOC_LDI_PM_HI,
+    'R_AVR_LO8_LDI_GS': RELOC_LDI_PM_LO,
+    'R_AVR_HI8_LDI_GS': RELOC_LDI_PM_HI,
+    'R_AVR_LO8_LDI_NEG': RELOC_LDI_LO | RELOC_NEG,
+    'R_AVR_HI8_LDI_NEG': RELOC_LDI_HI | RELOC_NEG,
+    'R_AVR_LO8_LDI_PM_NEG': RELOC_LDI_PM_LO | RELOC_NEG,
+    'R_AVR_HI8_LDI_PM_NEG': RELOC_LDI_PM_HI | RELOC_NEG,
+}
+
+ELF_DATA_RELOC_TYPES = {
+    'R_AVR_16': RELOC_DATA_WORD,
+    'R_AVR_LO8_LDI': RELOC_DATA_LDI_LO,
+    'R_AVR_HI8_LDI': RELOC_DATA_LDI_HI,
+    'R_AVR_LO8_LDI_NEG': RELOC_DATA_LDI_LO | RELOC_NEG,
+    'R_AVR_HI8_LDI_NEG': RELOC_DATA_LDI_HI | RELOC_NEG,
+}
+
+# Relative jumps and branches don't need to be patched.
+ELF_RELATIVE_RELOCS = {'R_AVR_7_PCREL', 'R_AVR_13_PCREL', 'R_AVR_NONE'}
+
+# The start of the RAM in the AVR address space. References to the RAM outside the task's data don't change when a
+# task moves.
+RAM_START = 0x800000
+# The task's .data and .bss are linked here, and moved to where the kernel puts them.
+DATA_LINK_ADDR = 0x800100
+# The most .data and .bss a task can have. This is TASK_DATA_ARENA_SIZE in config.h.
+MAX_TASK_DATA = 64
+# Where the kernel puts the table of syscalls. See scheduler_funcs.h.
+SCHEDULER_FUNCS_ADDR = 0x800440
+
+# The bin directory of the AVR toolchain. Set AVR_TOOL_PATH to use another one, or set it to nothing to use the
+# tools on the PATH, like on Linux.
+tool_path = os.environ.get('AVR_TOOL_PATH',
+                           'C:/Program Files (x86)/Atmel/Studio/7.0/toolchain/avr8/avr8-gnu-toolchain/bin/')
+# The device support for the atmega168 from Atmel Studio. The avr-gcc packages on Linux have it built in.
+device_pack_path = 'C:/Program Files (x86)/Atmel/Studio/7.0/Packs/atmel/ATmega_DFP/1.6.364/gcc/dev/atmega168'
 
 project_path = os.path.abspath(os.path.join(
     os.path.dirname(__file__), '..', '..'))
@@ -51,12 +202,148 @@ elf_out = project_path + '/basic_scheduler5/python/out/task.elf'
 task_dump = project_path + '/basic_scheduler5/python/out/task.bin'
 
 
-def compile_task(object_file, start_offset):
-    section_addr = f'0x{start_offset:X}'
+def slip_encode(data):
+    out = bytearray()
+    for b in data:
+        if b == SLIP_END:
+            out += bytes([SLIP_ESC, SLIP_ESC_END])
+        elif b == SLIP_ESC:
+            out += bytes([SLIP_ESC, SLIP_ESC_ESC])
+        else:
+            out.append(b)
+    return bytes(out)
+
+
+def send_packet(ser, channel, data):
+    ser.write(bytes([SLIP_END]) + slip_encode(bytes([channel]) + data) + bytes([SLIP_END]))
+
+
+def frame_crc(data):
+    # CRC-16/CCITT starting from 0xFFFF.
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def fault_name(fault):
+    return FAULT_NAMES.get(fault, f'fault {fault}')
+
+
+class CmdError(Exception):
+    pass
+
 
-    ret = subprocess.call([tool_path + "avr-gcc.exe", "-o", elf_out, object_file, '-nostartfiles', '-Wl,-static',
-                           f'-Wl,-section-start=.text={section_addr}', f'-Wl,-section-start=.scheduler_funcs=0x800310', '-mmcu=atmega168', '-B',
-                           'C:\Program Files (x86)\Atmel\Studio\7.0\Packs\atmel\ATmega_DFP\1.6.364\gcc\dev\atmega168'])
+class CmdRejected(CmdError):
+    """The device answered the command with an error, rather than not answering."""
+    pass
+
+
+class DeviceLink:
+    """Sends framed commands to the kernel and reads the responses.
+
+    Bytes from the device that aren't part of a frame are task output and are passed to on_output.
+    """
+
+    def __init__(self, ser, on_output=None):
+        self.ser = ser
+        self.on_output = on_output
+        self.seq = random.randrange(256)
+
+    def next_seq(self):
+        self.seq = (self.seq + 1) & 0xFF
+        return self.seq
+
+    def send_frame(self, seq, cmd, payload):
+        body = bytes([seq, cmd]) + payload
+        if len(body) > CMD_FRAME_MAX_BODY:
+            raise CmdError('Command too long.')
+        frame = bytes([len(body)]) + body
+        send_packet(self.ser, KERNEL_CHANNEL, frame + struct.pack('<H', frame_crc(frame)))
+
+    def read_frame(self):
+        """Returns (seq, status, payload) for the next valid frame, or None on a timeout."""
+        while True:
+            data = self.read_slip_frame()
+            if data is None:
+                return None
+            # Drop frames that are corrupted.
+            if len(data) < 5 or data[0] != len(data) - 3:
+                continue
+            if frame_crc(bytes(data[:-2])) != struct.unpack('<H', data[-2:])[0]:
+                continue
+            # Faults can be reported at any time, not just in response to a command.
+            if data[2] == STATUS_FAULT and len(data) == 7:
+                print(Fore.RED + f'Task {data[3]} stopped: {fault_name(data[4])}')
+                reset_style()
+                continue
+            return (data[1], data[2], bytes(data[3:-2]))
+
+    def read_slip_frame(self):
+        # Skip to the start of a frame.
+        while True:
+            c = self.ser.read(1)
+            if not c:
+                return None
+            if c[0] == SLIP_END:
+                break
+            if self.on_output:
+                self.on_output(c)
+
+        data = bytearray()
+        while True:
+            c = self.ser.read(1)
+            if not c:
+                return None
+            b = c[0]
+            if b == SLIP_END:
+                # Two ENDs in a row means the first one was the end of a frame we missed the start of.
+                if len(data) == 0:
+                    continue
+                break
+            if b == SLIP_ESC:
+                c = self.ser.read(1)
+                if not c:
+                    return None
+                b = SLIP_END if c[0] == SLIP_ESC_END else SLIP_ESC
+            data.append(b)
+        return data
+
+    def read_response(self, seq):
+        """Returns (status, payload) for the response to seq, or None on a timeout."""
+        while True:
+            frame = self.read_frame()
+            if frame is None:
+                return None
+            (resp_seq, status, payload) = frame
+            # A NAK can't know the sequence number of the frame it's for.
+            if resp_seq == seq or status == STATUS_NAK:
+                return (status, payload)
+
+    def command(self, cmd, payload=b''):
+        """Send a command and wait for it to be acknowledged. Returns the response payload."""
+        seq = self.next_seq()
+        for _ in range(CMD_RETRIES):
+            self.send_frame(seq, cmd, payload)
+            resp = self.read_response(seq)
+            if resp is None or resp[0] == STATUS_NAK:
+                continue
+            (status, data) = resp
+            if status == STATUS_ERROR:
+                raise CmdRejected(f'Command {cmd} rejected by the device.')
+            return data
+        raise CmdError(f'No response to command {cmd}.')
+
+
+def compile_task(object_file):
+    """Link the task at address 0.
+
+    Returns the code, the initial values of .data, the size of .bss, and the relocations as (offset, type, target)
+    tuples. The offsets of the relocations in .data are from the start of the code.
+    """
+    os.makedirs(os.path.dirname(elf_out), exist_ok=True)
+    device_args = ['-B', device_pack_path] if os.path.isdir(device_pack_path) else []
+    ret = subprocess.call([tool_path + "avr-gcc", "-o", elf_out, object_file, '-nostartfiles', '-Wl,-static',
+                           '-Wl,--emit-relocs', '-Wl,-section-start=.text=0x0',
+                           f'-Wl,-section-start=.data=0x{DATA_LINK_ADDR:X}',
+                           f'-Wl,-section-start=.scheduler_funcs=0x{SCHEDULER_FUNCS_ADDR:X}', '-mmcu=atmega168'] + device_args)
     if ret:
         exit(1)
 
@@ -65,25 +352,131 @@ def compile_task(object_file, start_offset):
     output = proc.stdout.decode('utf-8').replace('\r', '')
 
     # Generate dump of loaded task
-    with open(f'{elf_out}.{start_offset}.lss', "w") as outfile:
+    with open(f'{elf_out}.lss', "w") as outfile:
         outfile.write(output)
 
-    # Check for .data usage
+    # Get the .bss size. The .data size comes from its contents.
+    bss_size = 0
     for line in output.splitlines():
         if "Disassembly" in line:
             break
         fields = line.split()
-        if len(fields) == 7:
-            if fields[1] == ".scheduler_funcs":
-                continue
-            if fields[3].startswith('0080') and int(fields[2],16) != 0:
-                print("Tasks can't use the RAM directly. All data must be on the stack.")
-                exit(1) 
+        if len(fields) == 7 and fields[1] == '.bss':
+            bss_size = int(fields[2], 16)
 
     ret = subprocess.call([tool_path + 'avr-objcopy', "-O",
                           "binary", "--only-section=.text", elf_out, task_dump])
     if ret:
         exit(1)
+    with open(task_dump, 'rb') as fd:
+        code = fd.read()
+
+    ret = subprocess.call([tool_path + 'avr-objcopy', "-O",
+                          "binary", "--only-section=.data", elf_out, task_dump])
+    if ret:
+        exit(1)
+    with open(task_dump, 'rb') as fd:
+        data = fd.read()
+
+    if len(data) + bss_size > MAX_TASK_DATA:
+        print(f'The task uses {len(data) + bss_size} bytes of RAM. The max is {MAX_TASK_DATA}.')
+        exit(1)
+
+    return code, data, bss_size, get_relocs(len(code), len(data) + bss_size)
+
+
+def get_relocs(code_size, data_size):
+    # The relocations kept by --emit-relocs have the final addresses.
+    proc = subprocess.run([tool_path + 'avr-readelf', '-r', '-W', elf_out], stdout=subprocess.PIPE)
+    output = proc.stdout.decode('utf-8').replace('\r', '')
+    relocs = []
+    section = None
+    for line in output.splitlines():
+        if line.startswith('Relocation section'):
+            section = line.split("'")[1]
+            continue
+        fields = line.split()
+        if section not in ('.rela.text', '.rela.data') or len(fields) < 4 or not fields[2].startswith('R_AVR_'):
+            continue
+        offset = int(fields[0], 16)
+        if section == '.rela.data':
+            # The initial values of .data are stored after the code.
+            offset = offset - DATA_LINK_ADDR + code_size
+        elf_type = fields[2]
+        target = int(fields[3], 16)
+        if '+' in fields:
+            target += int(fields[fields.index('+') + 1], 16)
+        elif '-' in fields:
+            target -= int(fields[fields.index('-') + 1], 16)
+        if elf_type in ELF_RELATIVE_RELOCS:
+            continue
+        if DATA_LINK_ADDR <= target < DATA_LINK_ADDR + data_size:
+            if elf_type not in ELF_DATA_RELOC_TYPES:
+                print(f"Can't relocate {elf_type} to the data at 0x{offset:X}.")
+                exit(1)
+            relocs.append((offset, ELF_DATA_RELOC_TYPES[elf_type], target - DATA_LINK_ADDR))
+        elif target >= RAM_START:
+            continue
+        elif elf_type == 'R_AVR_CALL':
+            # The address is the second word of the instruction.
+            relocs.append((offset + 2, RELOC_WORD_PM, target))
+        elif elf_type in ELF_RELOC_TYPES:
+            relocs.append((offset, ELF_RELOC_TYPES[elf_type], target))
+        else:
+            print(f"Can't relocate {elf_type} at 0x{offset:X}.")
+            exit(1)
+    return sorted(relocs)
+
+
+def build_image(object_file):
+    code, data, bss_size, relocs = compile_task(object_file)
+    image = struct.pack(image_header_format, IMAGE_MAGIC, len(code), len(relocs), len(data), bss_size) + code + data
+    for reloc in relocs:
+        image += struct.pack(reloc_format, *reloc)
+    return image
+
+
+def read_task_image(path):
+    """Returns a dict with the parts of a task image, or builds it if path is an object file.
+
+    'code' includes the initial values of .data since they're patched the same way.
+    """
+    with open(path, 'rb') as fd:
+        data = fd.read()
+    if not data.startswith(IMAGE_MAGIC):
+        data = build_image(path)
+    (_, code_size, num_relocs, data_size, bss_size) = struct.unpack(image_header_format, data[:image_header_size])
+    code_end = image_header_size + code_size + data_size
+    table = data[code_end:code_end + num_relocs * reloc_size]
+    return {
+        'code': data[image_header_size:code_end],
+        'relocs': [struct.unpack(reloc_format, table[i:i + reloc_size]) for i in range(0, len(table), reloc_size)],
+        'reloc_table': table,
+        'data_size': data_size,
+        'bss_size': bss_size,
+    }
+
+
+def apply_relocs(code, relocs, base, data_base):
+    """Patch the code for where it's loaded in the same way the kernel does."""
+    code = bytearray(code)
+    for (offset, reloc_type, target) in relocs:
+        negate = reloc_type & RELOC_NEG
+        reloc_type &= ~RELOC_NEG
+        addr = (target + base) & 0xFFFF
+        if reloc_type >= RELOC_DATA_WORD:
+            addr = (target + data_base) & 0xFFFF
+        elif reloc_type in (RELOC_WORD_PM, RELOC_LDI_PM_LO, RELOC_LDI_PM_HI):
+            addr >>= 1
+        if reloc_type in (RELOC_WORD, RELOC_WORD_PM, RELOC_DATA_WORD):
+            code[offset:offset + 2] = struct.pack('<H', addr)
+        else:
+            if negate:
+                addr = -addr & 0xFFFF
+            value = addr >> 8 if reloc_type in (RELOC_LDI_HI, RELOC_LDI_PM_HI, RELOC_DATA_LDI_HI) else addr & 0xFF
+            code[offset] = (code[offset] & 0xF0) | (value & 0x0F)
+            code[offset + 1] = (code[offset + 1] & 0xF0) | (value >> 4)
+    return bytes(code)
 
 
 def get_loaded_tasks(task_state):
@@ -100,77 +493,342 @@ def get_sorted_tasks_with_pages(task_state):
     return loaded_tasks
 
 
-def load_task(ser, object_file, task_name, task_state):
-    found_task = None
-    # Check for free task
+def place_task(link, idx, size, data_size):
+    """Returns the flash offset and data address for the task."""
+    try:
+        data = link.command(PLACE_CMD, struct.pack(place_header_format, idx, size, data_size))
+    except CmdError:
+        print('Not enough memory available. Delete a task first.')
+        exit(1)
+    return struct.unpack('<HH', data)
+
+
+def get_erase_counts(link):
+    data = link.command(ERASE_COUNTS_CMD)
+    return list(struct.unpack(f'<{len(data) // 2}H', data))
+
+
+def draw_erase_counts(counts):
+    for i, count in enumerate(counts):
+        print(f'Page {i}: {count}')
+    print(f'Min {min(counts)}, max {max(counts)}')
+
+
+def drain_trace(link):
+    """Returns (records, dropped) with the records as (time, type, arg) tuples in ticks, oldest first."""
+    try:
+        data = link.command(TRACE_CMD)
+    except CmdRejected:
+        # The kernel answers CMD_TRACE with an error when TRACE isn't defined. A timeout is reported as usual.
+        print('The firmware was built without TRACE. Define TRACE in config.h, or build with '
+              'make KERNEL_DEFS=-DTRACE, then flash the new firmware.')
+        exit(1)
+    (now, dropped) = struct.unpack(trace_header_format, data[:trace_header_size])
+    body = data[trace_header_size:]
+    records = [struct.unpack(trace_record_format, body[i:i + trace_record_size])
+               for i in range(0, len(body), trace_record_size)]
+    # Only the low 16 bits of each time are recorded. Working back from the current time, each record is assumed to
+    # be less than a timer period (262ms) before the next one.
+    full = []
+    ticks = now
+    for (record_type, arg, low) in reversed(records):
+        ticks -= (ticks - low) & 0xFFFF
+        full.append((ticks, record_type, arg))
+    full.reverse()
+    return full, dropped
+
+
+def trace_to_chrome(records, task_state):
+    """Convert trace records to the Chrome trace event format, which Perfetto can also open."""
+    # Thread 0 is the kernel and the interrupts. Task i is thread i + 1.
+    events = [{'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': 0, 'args': {'name': 'kernel'}}]
+    for task in task_state['tasks']:
+        name = task['name'] if task['size'] > 0 else f'task {task["index"]}'
+        events.append({'name': 'thread_name', 'ph': 'M', 'pid': 0, 'tid': task['index'] + 1, 'args': {'name': name}})
+    start = records[0][0] if records else 0
+    running = None
+    for (ticks, record_type, arg) in records:
+        ts = (ticks - start) * US_PER_TICK
+        if record_type == TRACE_SWITCH_IN:
+            running = arg
+            events.append({'name': 'run', 'ph': 'B', 'pid': 0, 'tid': arg + 1, 'ts': ts})
+        elif record_type in (TRACE_SWITCH_OUT, TRACE_PREEMPT):
+            # The trace may start in the middle of a task running.
+            if running == arg:
+                name = 'preempted' if record_type == TRACE_PREEMPT else 'suspend'
+                events.append({'name': 'run', 'ph': 'E', 'pid': 0, 'tid': arg + 1, 'ts': ts, 'args': {'end': name}})
+            running = None
+        elif record_type == TRACE_WAKE:
+            events.append({'name': 'wake', 'ph': 'i', 's': 't', 'pid': 0, 'tid': arg + 1, 'ts': ts})
+        elif record_type in TRACE_LOCK_NAMES:
+            events.append({'name': f'lock {arg & 0x0F} {TRACE_LOCK_NAMES[record_type]}', 'ph': 'i', 's': 't',
+                           'pid': 0, 'tid': (arg >> 4) + 1, 'ts': ts})
+        elif record_type == TRACE_UART_RX:
+            events.append({'name': 'uart rx', 'ph': 'i', 's': 't', 'pid': 0, 'tid': 0, 'ts': ts,
+                           'args': {'channel': arg}})
+        elif record_type == TRACE_UART_TX_DONE:
+            events.append({'name': 'uart tx done', 'ph': 'i', 's': 't', 'pid': 0, 'tid': 0, 'ts': ts})
+    return {'traceEvents': events, 'displayTimeUnit': 'ms'}
+
+
+def record_trace(link, task_state, out_file, duration):
+    records = []
+    dropped = 0
+    end_time = time.monotonic() + duration
+    while time.monotonic() < end_time:
+        (new_records, new_dropped) = drain_trace(link)
+        records += new_records
+        dropped += new_dropped
+        time.sleep(0.05)
+    with open(out_file, 'w') as fd:
+        json.dump(trace_to_chrome(records, task_state), fd)
+    print(f'{len(records)} records written to {out_file}.')
+    if dropped:
+        print(f'{dropped} records were dropped because the trace buffer filled up between drains.')
+
+
+def get_stats(link):
+    try:
+        data = link.command(STATS_CMD)
+    except CmdRejected:
+        print('The firmware was built without TASK_STATS. Define TASK_STATS in config.h, then flash the new firmware.')
+        exit(1)
+    (version, now, idle, num_tasks, entry_size) = struct.unpack(stats_header_format, data[:stats_header_size])
+    if version < STATS_VERSION or entry_size < task_stats_size:
+        print(f'Unsupported stats version {version}.')
+        exit(1)
+    stats = {'now': now, 'idle': idle, 'tasks': []}
+    for i in range(num_tasks):
+        start = stats_header_size + i * entry_size
+        fields = struct.unpack(task_stats_format, data[start:start + task_stats_size])
+        stats['tasks'].append({
+            'run_ticks': fields[0],
+            'dispatches': fields[1],
+            'max_slice_ticks': fields[2],
+            'lock_wait_ticks': fields[3],
+            'missed_deadlines': fields[4],
+        })
+    return stats
+
+
+def draw_top(task_state, stats, prev_stats):
+    """Show the stats with the CPU use since the last update."""
+    # Clear the screen and move to the top left.
+    print('\033[2J\033[H', end='')
+    elapsed = (stats['now'] - prev_stats['now']) & 0xFFFFFFFF
+    if elapsed == 0:
+        elapsed = 1
+    idle = (stats['idle'] - prev_stats['idle']) & 0xFFFFFFFF
+    print(f'Idle {100 * idle / elapsed:5.1f}%')
+    print(f'{"Task":20} {"CPU":>6} {"Switches":>9} {"Max run ms":>11} {"Lock wait ms":>13} {"Missed":>7}')
     for task in task_state['tasks']:
         if task['size'] == 0:
+            continue
+        cur = stats['tasks'][task['index']]
+        prev = prev_stats['tasks'][task['index']]
+        # The counters are cleared when a task is enabled.
+        if cur['dispatches'] < prev['dispatches']:
+            prev = {key: 0 for key in prev}
+        run = cur['run_ticks'] - prev['run_ticks']
+        name = f'{task["index"]}: {task["name"]}'
+        color = Fore.GREEN if task['enabled'] else Fore.RED
+        print(color + f'{name:20}', end='')
+        reset_style()
+        print(f' {100 * run / elapsed:5.1f}% {cur["dispatches"] - prev["dispatches"]:9} '
+              f'{cur["max_slice_ticks"] * US_PER_TICK / 1000:11.2f} '
+              f'{cur["lock_wait_ticks"] * US_PER_TICK / 1000:13.1f} {cur["missed_deadlines"]:7}')
+
+
+def run_top(link, task_state, interval):
+    prev_stats = get_stats(link)
+    try:
+        while True:
+            time.sleep(interval)
+            # Pick up tasks that were enabled, disabled, or loaded since the last update.
+            task_state = get_task_list(link)
+            stats = get_stats(link)
+            draw_top(task_state, stats, prev_stats)
+            prev_stats = stats
+    except KeyboardInterrupt:
+        pass
+
+
+def get_page_crcs(link, offset, size):
+    data = link.command(PAGE_CRC_CMD, struct.pack(page_crc_header_format, offset, size))
+    return list(struct.unpack(f'<{len(data) // 2}H', data))
+
+
+def lz_compress_pages(task_data, send_pages, patched_data):
+    """Compress each page in send_pages separately. Returns a dict of page index to the compressed bytes.
+
+    The kernel uses its two page buffers as the window, so matches can only reach back into the previous page if it
+    was also sent. The previous page has already been patched, so patched_data is used for it.
+    """
+    pages = {}
+    for page in send_pages:
+        start = page * PAGE_SIZE
+        end = min(start + PAGE_SIZE, len(task_data))
+        window_start = start - PAGE_SIZE if page - 1 in send_pages else start
+        out = bytearray()
+        literals = bytearray()
+
+        def flush_literals():
+            while literals:
+                run = literals[:LZ_MAX_LITERALS]
+                out.append(len(run) - 1)
+                out.extend(run)
+                del literals[:LZ_MAX_LITERALS]
+
+        def window_byte(i):
+            return patched_data[i] if i < start else task_data[i]
+
+        pos = start
+        while pos < end:
+            best_len = 0
+            best_dist = 0
+            for src in range(max(window_start, pos - LZ_MAX_DIST), pos):
+                length = 0
+                # The match can overlap the bytes it's writing, since they're copied one at a time.
+                while length < LZ_MAX_MATCH and pos + length < end and \
+                        window_byte(src + length) == task_data[pos + length]:
+                    length += 1
+                if length > best_len:
+                    best_len = length
+                    best_dist = pos - src
+            if best_len >= LZ_MIN_MATCH:
+                flush_literals()
+                out.append(0x80 | (best_len - LZ_MIN_MATCH))
+                out.append(best_dist)
+                pos += best_len
+            else:
+                literals.append(task_data[pos])
+                pos += 1
+        flush_literals()
+        pages[page] = bytes(out)
+    return pages
+
+
+def load_task(link, image_file, task_name, task_state, priority, stack_size, full, compress):
+    found_task = None
+    # A task with the same name is replaced. The kernel keeps it in the same place unless other pages are less worn,
+    # so usually only the changed pages need to be written.
+    for task in get_loaded_tasks(task_state):
+        if task['name'] == task_name:
             found_task = task
             break
 
+    # Check for free task
+    if found_task is None:
+        for task in task_state['tasks']:
+            if task['size'] == 0:
+                found_task = task
+                break
+
     if found_task is None:
         print('No task slots available. Delete a task first.')
         exit(1)
 
-    # Get the binary size
-    compile_task(object_file, 0x100)
-    file_size = os.path.getsize(task_dump)
-    pages_needed = int(math.ceil(file_size/float(PAGE_SIZE)))
-
-    TOTAL_PAGES = int(task_state['task_mem_size'] / PAGE_SIZE)
-    loaded_tasks = get_sorted_tasks_with_pages(task_state)
+    # The relocation table is stored after the code so the kernel can move the task later.
+    image = read_task_image(image_file)
+    relocs = image['relocs']
+    task_data = image['code'] + image['reloc_table']
+
+    # The kernel picks where the task goes based on the wear of the flash pages.
+    (start_offset, data_addr) = place_task(link, found_task['index'], len(task_data),
+                                           image['data_size'] + image['bss_size'])
+    patched_data = apply_relocs(image['code'], relocs, start_offset, data_addr) + image['reloc_table']
+
+    # Only send the pages that are different from what's already in the flash.
+    num_pages = int(math.ceil(len(task_data)/float(PAGE_SIZE)))
+    send_offsets = []
+    send_mask = 0
+    device_crcs = None if full else get_page_crcs(link, start_offset, len(task_data))
+    for i in range(num_pages):
+        page = patched_data[i*PAGE_SIZE:(i+1)*PAGE_SIZE]
+        if device_crcs is None or device_crcs[i] != frame_crc(page):
+            send_offsets.append(start_offset + i * PAGE_SIZE)
+            send_mask |= 1 << i
+
+    send_pages = [(o - start_offset) // PAGE_SIZE for o in send_offsets]
+    if compress:
+        page_data = lz_compress_pages(task_data, send_pages, patched_data)
+    else:
+        page_data = {i: task_data[i*PAGE_SIZE:(i+1)*PAGE_SIZE] for i in send_pages}
+    # Each page is followed by the relocations in it, which the kernel patches before writing the page. A word in
+    # .data can start on the last byte of a page, and the kernel patches each half with its own page.
+    for i in send_pages:
+        page_relocs = [reloc for reloc in relocs if reloc[0] // PAGE_SIZE == i or (reloc[0] + 1) // PAGE_SIZE == i]
+        page_data[i] += bytes([len(page_relocs)])
+        for reloc in page_relocs:
+            page_data[i] += struct.pack(reloc_format, *reloc)
+        # The kernel checks each page with the CRC of what was sent for it.
+        page_data[i] += struct.pack('<H', frame_crc(page_data[i]))
 
-    start_page = None
+    # Write Cmd
 
-    if len(loaded_tasks) == 0:
-        start_page = 0
+    data = struct.pack(write_header_format, found_task['index'], start_offset, len(
+        task_data), task_name.encode('ascii'), priority, send_mask, len(relocs), data_addr, image['data_size'],
+        image['bss_size'], stack_size)
+    start_time = time.monotonic()
+    for _ in range(CMD_RETRIES):
+        # The write is only sent again once the kernel has stopped reading pages, or it would take the frame for
+        # page data. It stops after a NAK, and when it doesn't get a page for 200ms, which is shorter than the serial
+        # timeout. The pages that were already written match and won't be written again.
+        seq = link.next_seq()
+        link.send_frame(seq, WRITE_LZ_CMD if compress else WRITE_CMD, data)
+        resp = link.read_response(seq)
+        # The kernel requests each page with its offset. It requests pages ahead of the ones it's writing as long as
+        # it has buffers for them, so the pages are sent as soon as they're requested. The page data is read by the
+        # kernel directly from the UART, so it isn't framed. The kernel sends an ACK with the number of pages it
+        # wrote after the last page is written.
+        sent = 0
+        while resp is not None and resp[0] == STATUS_PAGE:
+            if sent >= len(send_offsets) or struct.unpack('<H', resp[1])[0] != send_offsets[sent]:
+                raise CmdError('Unexpected response during write.')
+            print(send_offsets[sent])
+            link.ser.write(page_data[(send_offsets[sent] - start_offset) // PAGE_SIZE])
+            sent += 1
+            resp = link.read_response(seq)
+        if resp is None or resp[0] == STATUS_NAK:
+            print('The write was interrupted. Trying again.')
+            continue
+        (status, payload) = resp
+        if status == STATUS_ERROR:
+            raise CmdError('Write rejected by the device.')
+        if status != STATUS_ACK:
+            raise CmdError('Unexpected response during write.')
+        break
     else:
-        for i in range(len(loaded_tasks) - 1):
-            end_offset = loaded_tasks[i]['page_offset'] + \
-                loaded_tasks[i]['num_pages']
-            space = loaded_tasks[i+1]['page_offset'] - end_offset
-            if space >= pages_needed:
-                start_page = end_offset
-                break
+        raise CmdError('Write failed.')
 
-        if start_page is None:
-            end_offset = loaded_tasks[-1]['page_offset'] + \
-                loaded_tasks[-1]['num_pages']
-            space = TOTAL_PAGES - end_offset
-            if space >= pages_needed:
-                start_page = end_offset
-            else:
-                print('Not enough memory available. Delete a task first.')
-                exit()
+    elapsed = time.monotonic() - start_time
+    sent_bytes = sum(len(page) for page in page_data.values())
+    print(f'Sent {len(send_offsets)} of {num_pages} pages ({sent_bytes} of {len(task_data)} bytes) '
+          f'in {elapsed:.2f}s ({len(task_data) / 1024 / elapsed:.1f} KB/s). Wrote {payload[0]} pages to flash.')
 
-    start_offset = start_page * PAGE_SIZE + task_state['task_mem_offset']
-    compile_task(object_file, start_offset)
-    with open(task_dump, 'rb') as fd:
-        task_data = fd.read()
 
-    # Write Cmd
+def defrag_tasks(link, task_state):
+    """Move the tasks down to the start of the task memory so the free space is in one piece."""
+    next_offset = task_state['task_mem_offset']
+    for task in get_sorted_tasks_with_pages(task_state):
+        if task['offset'] > next_offset:
+            print(f'Moving {task["name"]} from {task["offset"]} to {next_offset}')
+            link.command(MOVE_CMD, struct.pack(move_header_format, task['index'], next_offset))
+        next_offset += task['num_pages'] * PAGE_SIZE
+
 
-    data = struct.pack(write_header_format, WRITE_CMD, found_task['index'], start_offset, len(
-        task_data), task_name.encode('ascii'))
-    ser.write(data)
-    i = 0
-    while i < len(task_data):
-        data = ser.read(2)
-        print(struct.unpack('<H', data)[0])
-        ser.write(task_data[i:i+PAGE_SIZE])
-        i += PAGE_SIZE
+def del_task(link, idx):
+    link.command(DELETE_CMD, struct.pack(del_header_format, idx))
 
 
-def del_task(ser, idx):
-    data = struct.pack(del_header_format, DELETE_CMD, idx)
-    ser.write(data)
+def set_priority(link, idx, priority):
+    link.command(PRIORITY_CMD, struct.pack(priority_header_format, idx, priority))
 
 
-def get_task_list(ser):
-    ser.write(bytes([LIST_CMD]))
-    data = ser.read(list_header_size)
+def get_task_list(link):
+    data = link.command(LIST_CMD)
     (num_tasks, task_mem_offset, task_mem_size) = struct.unpack(
-        list_header_format, data)
+        list_header_format, data[:list_header_size])
     task_state = {
         'num_tasks': num_tasks,
         'task_mem_offset': task_mem_offset,
@@ -178,8 +836,8 @@ def get_task_list(ser):
         'tasks': []
     }
     for i in range(num_tasks):
-        data = ser.read(task_struct_size)
-        task = struct.unpack(task_struct_format, data)
+        start = list_header_size + i * task_struct_size
+        task = struct.unpack(task_struct_format, data[start:start + task_struct_size])
         task_state['tasks'].append({
             'stack_ptr': task[0],
             'offset': task[1],
@@ -187,15 +845,24 @@ def get_task_list(ser):
             'name': task[3].decode("ascii").replace('\x00', ''),
             'size': task[4],
             'enabled': task[5],
+            'priority': task[6],
+            'base_priority': task[7],
+            'stack_size': task[9],
+            'stack_used': task[10],
+            'fault': task[11],
             'index': i,
         })
     return task_state
 
 
-def enable_task(ser, idx, is_enabled):
+def enable_task(link, idx, is_enabled):
     enable_val = 1 if is_enabled else 0
-    data = struct.pack(enable_header_format, ENABLE_CMD, idx, enable_val)
-    ser.write(data)
+    try:
+        link.command(ENABLE_CMD, struct.pack(enable_header_format, idx, enable_val))
+    except CmdError:
+        # The stack is allocated when the task is enabled.
+        print("Couldn't enable the task. There may not be enough stack space, so try disabling a task first.")
+        exit(1)
 
 
 def reset_style():
@@ -212,8 +879,16 @@ def draw_tasks(task_state):
                 color = Fore.GREEN
             else:
                 color = Fore.RED
-            print(color + task["name"])
+            print(color + task["name"], end='')
             reset_style()
+            print(f' (priority {task["priority"]}', end='')
+            if task['enabled']:
+                print(f', stack {task["stack_used"]}/{task["stack_size"]}', end='')
+            print(')', end='')
+            if task['fault']:
+                print(Fore.RED + f' stopped: {fault_name(task["fault"])}', end='')
+                reset_style()
+            print()
         else:
             print(f'Task {task["index"]} not loaded')
 
@@ -246,12 +921,16 @@ def get_task(task_id: str, task_state):
     return -1
 
 
-def term_input_func(ser):
+def print_task_output(data):
+    print(Fore.CYAN + data.decode('ascii', errors='replace'), end='', flush=True)
+    reset_style()
+
+
+def term_input_func(link):
     try:
         while True:
-            c = ser.read().decode('ascii')
-            print(Fore.CYAN + c, end='')
-            reset_style()
+            # Any kernel frames are dropped.
+            link.read_frame()
     except:
       pass
 
@@ -280,7 +959,8 @@ EXAMPLE USAGE
 
     term_parser = command_subparsers.add_parser(
         'term',
-        help='Open a terminal to the device.')
+        help='Open a terminal to the device. Input is sent to the given task.')
+    term_parser.add_argument('task', help='The name or id of the task to send input to.')
 
     enable_parser = command_subparsers.add_parser(
         'enable',
@@ -294,7 +974,50 @@ EXAMPLE USAGE
         help='Load a task into chip flash.')
     load_parser.add_argument('name', help='The name for the task.')
     load_parser.add_argument(
-        'object_file', help='The compiled object file for the task.')
+        'task_file', help='The task image from the build command, or the compiled object file for the task.')
+    load_parser.add_argument(
+        '--priority', type=int, default=0, help='The priority for the task. Higher values run first.')
+    load_parser.add_argument(
+        '--full', action='store_true', help="Send every page even if it's unchanged on the device.")
+    load_parser.add_argument(
+        '--compress', action='store_true', help='Compress the pages to reduce the upload time.')
+    load_parser.add_argument(
+        '--stack', type=int, default=0,
+        help='The stack size for the task in bytes. The kernel default is used if this is 0. The kernel '
+             'rejects sizes under MIN_STACK_SIZE in config.h.')
+
+    priority_parser = command_subparsers.add_parser(
+        'priority',
+        help='Set the priority of a task by name or index.')
+    priority_parser.add_argument('task', help='The name or id of the task.')
+    priority_parser.add_argument(
+        'priority', type=int, help='The priority for the task. Higher values run first.')
+
+    build_parser = command_subparsers.add_parser(
+        'build',
+        help='Build a task image from an object file. The image can be loaded anywhere without the compiler.')
+    build_parser.add_argument('object_file', help='The compiled object file for the task.')
+    build_parser.add_argument('image_file', help='Where to write the task image.')
+
+    command_subparsers.add_parser(
+        'defrag',
+        help='Move the tasks together so the free task memory is in one piece.')
+
+    command_subparsers.add_parser(
+        'wear',
+        help='Show how many times each page of the task memory has been erased.')
+
+    top_parser = command_subparsers.add_parser(
+        'top',
+        help='Show how much of the CPU each task is using. Needs a kernel built with TASK_STATS.')
+    top_parser.add_argument('--interval', type=float, default=1, help='The seconds between updates.')
+
+    trace_parser = command_subparsers.add_parser(
+        'trace',
+        help='Record a trace of the kernel and write it as Chrome trace JSON. Needs a kernel built with TRACE '
+             '(make KERNEL_DEFS=-DTRACE).')
+    trace_parser.add_argument('out_file', help='Where to write the trace. Open it with Perfetto or chrome://tracing.')
+    trace_parser.add_argument('--duration', type=float, default=5, help='How many seconds to record for.')
 
     del_parser = command_subparsers.add_parser(
         'del',
@@ -303,6 +1026,12 @@ EXAMPLE USAGE
 
     args = parser.parse_args()
 
+    # Building doesn't need the device.
+    if args.command == 'build':
+        with open(args.image_file, 'wb') as fd:
+            fd.write(build_image(args.object_file))
+        return
+
     if args.device_port == 'auto':
         ports = list_ports.comports()
         port_name = ports[0].name
@@ -317,40 +1046,62 @@ EXAMPLE USAGE
             parser.print_help()
             sys.exit(0)
 
-        task_state = get_task_list(ser)
-        if hasattr(args, 'task'):
-            idx = get_task(args.task, task_state)
-            if idx == -1:
-                print(f'Task {args.task} not found.')
-                exit(1)
-
-        if args.command == 'list':
-            draw_tasks(task_state)
-        elif args.command == 'enable':
-            if task_state['tasks'][idx]['size'] == 0:
-                print(f"Can't enable task {idx} since no task is loaded.")
-            is_enabled = args.is_enabled == "1" or args.is_enabled.lower() == 'true'
-            enable_task(ser, idx, is_enabled)
-        elif args.command == 'load':
-            if len(args.name) > 15:
-                print(f"{args.name} too long. Max length 15 characters.")
-                exit(1)
-            load_task(ser, args.object_file, args.name, task_state)
-        elif args.command == 'del':
-            if task_state['tasks'][idx]['size'] == 0:
-                print(f'Task {args.task} already deleted.')
-                exit(0)
-            del_task(ser, idx)
-        elif args.command == 'term':
-            threading.Thread(target=term_input_func,
-                             args=(ser,), daemon=True).start()
-            ser.timeout = None
-            try:
-                while 1:
-                    txt = input()
-                    ser.write(txt.encode('ascii'))
-            except:
-                exit(0)
+        link = DeviceLink(ser)
+        try:
+            run_command(args, link)
+        except CmdError as e:
+            print(e)
+            exit(1)
+
+
+def run_command(args, link):
+    ser = link.ser
+    task_state = get_task_list(link)
+    if hasattr(args, 'task'):
+        idx = get_task(args.task, task_state)
+        if idx == -1:
+            print(f'Task {args.task} not found.')
+            exit(1)
+
+    if args.command == 'list':
+        draw_tasks(task_state)
+    elif args.command == 'enable':
+        if task_state['tasks'][idx]['size'] == 0:
+            print(f"Can't enable task {idx} since no task is loaded.")
+        is_enabled = args.is_enabled == "1" or args.is_enabled.lower() == 'true'
+        enable_task(link, idx, is_enabled)
+    elif args.command == 'load':
+        if len(args.name) > 15:
+            print(f"{args.name} too long. Max length 15 characters.")
+            exit(1)
+        load_task(link, args.task_file, args.name, task_state, args.priority, args.stack, args.full,
+                  args.compress)
+    elif args.command == 'priority':
+        set_priority(link, idx, args.priority)
+    elif args.command == 'defrag':
+        defrag_tasks(link, task_state)
+    elif args.command == 'wear':
+        draw_erase_counts(get_erase_counts(link))
+    elif args.command == 'top':
+        run_top(link, task_state, args.interval)
+    elif args.command == 'trace':
+        record_trace(link, task_state, args.out_file, args.duration)
+    elif args.command == 'del':
+        if task_state['tasks'][idx]['size'] == 0:
+            print(f'Task {args.task} already deleted.')
+            exit(0)
+        del_task(link, idx)
+    elif args.command == 'term':
+        link.on_output = print_task_output
+        threading.Thread(target=term_input_func,
+                         args=(link,), daemon=True).start()
+        ser.timeout = None
+        try:
+            while 1:
+                txt = input()
+                send_packet(ser, idx + 1, txt.encode('ascii'))
+        except:
+            exit(0)
 
 
 if __name__ == '__main__':
@@ -358,5 +1109,7 @@ if __name__ == '__main__':
 
 # python basic_scheduler5/python/client.py list
 # python basic_scheduler5/python/client.py load Task1 task5/Debug/library.o
+# python basic_scheduler5/python/client.py build task5/Debug/library.o task5.tsk
+# python basic_scheduler5/python/client.py load Task1 task5.tsk
 # python basic_scheduler5/python/client.py enable Task1
 
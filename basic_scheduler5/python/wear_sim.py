@@ -0,0 +1,84 @@
+# Simulates the flash wear from repeatedly updating tasks to compare the old host side first fit placement with
+# the kernel's wear aware placement (PlaceTask in main.c).
+#
+# python basic_scheduler5/python/wear_sim.py --updates 10000
+
+from argparse import ArgumentParser
+import random
+
+TOTAL_PAGES = 16
+
+
+def first_fit(tasks, idx, num_pages, counts):
+    used = set()
+    for i, (start, size) in tasks.items():
+        if i != idx:
+            used.update(range(start, start + size))
+    for start in range(TOTAL_PAGES - num_pages + 1):
+        if not used.intersection(range(start, start + num_pages)):
+            return start
+    return None
+
+
+def wear_aware(tasks, idx, num_pages, counts):
+    used = set()
+    for i, (start, size) in tasks.items():
+        if i != idx:
+            used.update(range(start, start + size))
+    current = tasks[idx][0] if idx in tasks else None
+    best = None
+    for start in range(TOTAL_PAGES - num_pages + 1):
+        pages = range(start, start + num_pages)
+        if used.intersection(pages):
+            continue
+        key = (max(counts[p] for p in pages), start != current, sum(counts[p] for p in pages))
+        if best is None or key < best[0]:
+            best = (key, start)
+    return best[1] if best else None
+
+
+def simulate(place, delta, task_sizes, weights, updates, seed):
+    rng = random.Random(seed)
+    counts = [0] * TOTAL_PAGES
+    tasks = {}
+    for idx, size in enumerate(task_sizes):
+        start = place(tasks, idx, size, counts)
+        tasks[idx] = (start, size)
+        for p in range(start, start + size):
+            counts[p] += 1
+
+    for _ in range(updates):
+        idx = rng.choices(range(len(task_sizes)), weights)[0]
+        size = task_sizes[idx]
+        start = place(tasks, idx, size, counts)
+        if delta and start == tasks[idx][0]:
+            # A small change only rewrites the page it's in.
+            erased = [start + rng.randrange(size)]
+        else:
+            erased = range(start, start + size)
+        tasks[idx] = (start, size)
+        for p in erased:
+            counts[p] += 1
+    return counts
+
+
+def report(name, counts):
+    print(f'{name}: min {min(counts)}, max {max(counts)}, total {sum(counts)}')
+    print('  ' + ' '.join(str(c) for c in counts))
+
+
+def main():
+    parser = ArgumentParser(description='Compare the flash wear of the task placement strategies.')
+    parser.add_argument('--updates', type=int, default=10000, help='The number of task updates to simulate.')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+
+    # One task is updated much more often than the others, which is the case that wears out the low pages.
+    task_sizes = [3, 4, 2]
+    weights = [8, 1, 1]
+    report('First fit, full rewrite', simulate(first_fit, False, task_sizes, weights, args.updates, args.seed))
+    report('Wear aware, changed pages only', simulate(wear_aware, True, task_sizes, weights, args.updates, args.seed))
+
+
+if __name__ == '__main__':
+    main()
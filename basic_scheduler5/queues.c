@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "queues.h"
+#include "run_queue.h"
+#include "syscalls.h"
+
+// Used to track which task is active.
+extern uint8_t task_idx;
+
+struct MsgQueue {
+	// Index of the slot at the front of the queue.
+	uint8_t head;
+	// The number of messages in the queue.
+	uint8_t count;
+	// Bit i is set if tasks[i] is blocked waiting for space to send.
+	task_mask_t send_waiters;
+	// Bit i is set if tasks[i] is blocked waiting for a message.
+	task_mask_t receive_waiters;
+	uint8_t slots[QUEUE_DEPTH][QUEUE_MSG_SIZE];
+};
+
+static struct MsgQueue queues[NUM_QUEUES];
+
+void reset_queues() {
+	for (uint8_t i = 0; i < NUM_QUEUES; i++) {
+		queues[i].head = 0;
+		queues[i].count = 0;
+		queues[i].send_waiters = 0;
+		queues[i].receive_waiters = 0;
+	}
+}
+
+bool queue_try_send(uint8_t queue, const void* msg) {
+	if (queue >= NUM_QUEUES || queues[queue].count == QUEUE_DEPTH) {
+		return false;
+	}
+	struct MsgQueue* q = queues + queue;
+	uint8_t tail = q->head + q->count;
+	if (tail >= QUEUE_DEPTH) {
+		tail -= QUEUE_DEPTH;
+	}
+	memcpy(q->slots[tail], msg, QUEUE_MSG_SIZE);
+	q->count++;
+	run_queue_wake_one(&(q->receive_waiters));
+	return true;
+}
+
+void queue_send(uint8_t queue, const void* msg) {
+	// A task woken when space frees up might still find the queue full if another task got to it first.
+	while (queue < NUM_QUEUES && !queue_try_send(queue, msg)) {
+		queues[queue].send_waiters |= TASK_BIT(task_idx);
+		run_queue_block(task_idx);
+		suspend_task();
+	}
+}
+
+bool queue_try_receive(uint8_t queue, void* msg) {
+	if (queue >= NUM_QUEUES || queues[queue].count == 0) {
+		return false;
+	}
+	struct MsgQueue* q = queues + queue;
+	memcpy(msg, q->slots[q->head], QUEUE_MSG_SIZE);
+	q->head++;
+	if (q->head == QUEUE_DEPTH) {
+		q->head = 0;
+	}
+	q->count--;
+	run_queue_wake_one(&(q->send_waiters));
+	return true;
+}
+
+void queue_receive(uint8_t queue, void* msg) {
+	while (queue < NUM_QUEUES && !queue_try_receive(queue, msg)) {
+		queues[queue].receive_waiters |= TASK_BIT(task_idx);
+		run_queue_block(task_idx);
+		suspend_task();
+	}
+}
+
+void remove_queue_waiter(uint8_t idx) {
+	for (uint8_t i = 0; i < NUM_QUEUES; i++) {
+		queues[i].send_waiters &= ~TASK_BIT(idx);
+		queues[i].receive_waiters &= ~TASK_BIT(idx);
+	}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// A table of NUM_QUEUES fixed size message queues for passing data between tasks.
+// Messages are copied into slots owned by the kernel, so the sender's buffer can be reused as soon as the send
+// returns. Like the locks, blocked tasks are taken out of the run queue until the queue they're waiting on
+// changes.
+
+// Empty all the queues and forget any waiters.
+void reset_queues();
+
+// Copy QUEUE_MSG_SIZE bytes from msg to the back of the queue.
+// Returns false if the queue is full.
+bool queue_try_send(uint8_t queue, const void* msg);
+
+// Copy QUEUE_MSG_SIZE bytes from msg to the back of the queue, blocking while the queue is full.
+void queue_send(uint8_t queue, const void* msg);
+
+// Copy the message at the front of the queue to msg, which must have space for QUEUE_MSG_SIZE bytes.
+// Returns false if the queue is empty.
+bool queue_try_receive(uint8_t queue, void* msg);
+
+// Copy the message at the front of the queue to msg, blocking while the queue is empty.
+void queue_receive(uint8_t queue, void* msg);
+
+// Stop a task from waiting on any queue. Used when a task is disabled.
+void remove_queue_waiter(uint8_t idx);
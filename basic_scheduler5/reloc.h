@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Tasks are linked at address 0 and the kernel patches the absolute flash addresses in them for where they're
+// loaded. The relocation table is stored in flash after the task's code so the task can be moved later.
+// The task's .data and .bss are linked at the start of the RAM, and the references to them are patched for where
+// the kernel puts them in its data arena.
+
+enum RelocType {
+	// A 16 bit byte address, like a pointer to data in flash.
+	RELOC_WORD = 0,
+	// A 16 bit word address. Used for the address of call and jmp instructions and function pointers.
+	RELOC_WORD_PM = 1,
+	// The low or high byte of a byte address loaded with ldi.
+	RELOC_LDI_LO = 2,
+	RELOC_LDI_HI = 3,
+	// The low or high byte of a word address loaded with ldi.
+	RELOC_LDI_PM_LO = 4,
+	RELOC_LDI_PM_HI = 5,
+	// The same as RELOC_WORD, RELOC_LDI_LO and RELOC_LDI_HI, but for an address in the task's data.
+	RELOC_DATA_WORD = 6,
+	RELOC_DATA_LDI_LO = 7,
+	RELOC_DATA_LDI_HI = 8,
+	// Added to one of the ldi types when the instruction holds the negated address. There's no instruction to add
+	// a constant to a register, so the compiler uses subi and sbci with lo8(-(addr)) and hi8(-(addr)) instead.
+	RELOC_NEG = 0x80
+};
+
+struct TaskReloc {
+	// The offset of the 16 bit word to patch from the start of the task.
+	uint16_t offset;
+	uint8_t type;
+	// The address the task was linked with, relative to the start of the task or its data. Storing this rather
+	// than patching what's in flash means the patch doesn't depend on the current contents.
+	uint16_t target;
+};
+
+// The relocations are stored with no padding.
+#define TASK_RELOC_SIZE 5
+
+// Patch the word at data for the task starting at base with its data at data_base.
+static inline void reloc_apply(uint8_t* data, uint8_t type, uint16_t target, uint16_t base,
+                               uint16_t data_base) {
+	bool negate = type & RELOC_NEG;
+	type &= ~RELOC_NEG;
+	uint16_t addr = target + base;
+	if (type >= RELOC_DATA_WORD) {
+		addr = target + data_base;
+	} else if (type == RELOC_WORD_PM || type == RELOC_LDI_PM_LO || type == RELOC_LDI_PM_HI) {
+		addr >>= 1;
+	}
+	if (type == RELOC_WORD || type == RELOC_WORD_PM || type == RELOC_DATA_WORD) {
+		data[0] = addr & 0xFF;
+		data[1] = addr >> 8;
+		return;
+	}
+	if (negate) {
+		addr = -addr;
+	}
+	bool high = type == RELOC_LDI_HI || type == RELOC_LDI_PM_HI || type == RELOC_DATA_LDI_HI;
+	uint8_t value = high ? addr >> 8 : addr & 0xFF;
+	// ldi, subi and sbci are xxxx KKKK dddd KKKK, and the instruction is little endian.
+	data[0] = (data[0] & 0xF0) | (value & 0x0F);
+	data[1] = (data[1] & 0xF0) | (value >> 4);
+}
+
+// Patch the part of the word at offset that's in the page of page_size bytes at page_start. The pages are patched
+// one at a time, so a word that starts on the last byte of a page is patched half in each. Only the plain word
+// types can do that since the instructions are word aligned, and those don't depend on the bytes already there.
+static inline void reloc_apply_page(uint8_t* page, uint16_t page_start, uint16_t page_size, uint16_t offset,
+                                    uint8_t type, uint16_t target, uint16_t base, uint16_t data_base) {
+	if (offset >= page_start && offset - page_start < page_size - 1) {
+		reloc_apply(page + (offset - page_start), type, target, base, data_base);
+		return;
+	}
+	uint8_t word[2] = {0, 0};
+	if (offset == page_start + page_size - 1) {
+		reloc_apply(word, type, target, base, data_base);
+		page[page_size - 1] = word[0];
+	} else if (offset + 1 == page_start) {
+		reloc_apply(word, type, target, base, data_base);
+		page[0] = word[1];
+	}
+}
@@ -0,0 +1,155 @@
+#include "run_queue.h"
+#include "syscalls.h"
+#include "trace.h"
+
+// Defined in dispatch.c
+extern struct Task tasks[MAX_LD_TASKS];
+
+// Used to track which task is active.
+extern uint8_t task_idx;
+
+// Bit i of ready_mask[p] is set if tasks[i] is ready to run and has priority p.
+static task_mask_t ready_mask[NUM_PRIORITIES];
+// Bit p is set if ready_mask[p] is non-zero.
+static uint8_t ready_levels = 0;
+
+// Bit i is set if tasks[i] is waiting on something other than time, like a lock.
+static task_mask_t blocked_mask = 0;
+
+// Singly linked list of sleeping tasks sorted by next_run. The links are indexes into tasks.
+static uint8_t sleep_head = NO_TASK;
+static uint8_t sleep_next[MAX_LD_TASKS];
+
+// Compare two timer values allowing for the timer to have rolled over.
+// This has the same assumption as is_time_past that the times are within half the timer range of each other.
+static inline bool is_before(uint32_t a, uint32_t b) {
+	return (int32_t)(a - b) < 0;
+}
+
+static inline void set_ready(uint8_t idx, uint8_t priority) {
+	ready_mask[priority] |= TASK_BIT(idx);
+	ready_levels |= 1 << priority;
+}
+
+// Returns true if the task was ready.
+static inline bool clear_ready(uint8_t idx, uint8_t priority) {
+	if (!(ready_mask[priority] & TASK_BIT(idx))) {
+		return false;
+	}
+	ready_mask[priority] &= ~TASK_BIT(idx);
+	if (ready_mask[priority] == 0) {
+		ready_levels &= ~(1 << priority);
+	}
+	return true;
+}
+
+void run_queue_init() {
+	for (uint8_t i = 0; i < NUM_PRIORITIES; i++) {
+		ready_mask[i] = 0;
+	}
+	ready_levels = 0;
+	blocked_mask = 0;
+	sleep_head = NO_TASK;
+}
+
+void run_queue_ready(uint8_t idx) {
+	TRACE_EVENT(TRACE_WAKE, idx);
+	blocked_mask &= ~TASK_BIT(idx);
+	set_ready(idx, tasks[idx].priority);
+}
+
+uint8_t run_queue_wake_one(task_mask_t* waiters) {
+	uint8_t woken = NO_TASK;
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if ((*waiters & TASK_BIT(i)) && (woken == NO_TASK || tasks[i].priority > tasks[woken].priority)) {
+			woken = i;
+		}
+	}
+	if (woken != NO_TASK) {
+		*waiters &= ~TASK_BIT(woken);
+		run_queue_ready(woken);
+	}
+	return woken;
+}
+
+void run_queue_block(uint8_t idx) {
+	blocked_mask |= TASK_BIT(idx);
+}
+
+bool run_queue_is_blocked(uint8_t idx) {
+	return blocked_mask & TASK_BIT(idx);
+}
+
+void run_queue_set_priority(uint8_t idx, uint8_t priority) {
+	if (clear_ready(idx, tasks[idx].priority)) {
+		set_ready(idx, priority);
+	}
+	tasks[idx].priority = priority;
+}
+
+void run_queue_remove(uint8_t idx) {
+	blocked_mask &= ~TASK_BIT(idx);
+	clear_ready(idx, tasks[idx].priority);
+	uint8_t* link = &sleep_head;
+	while (*link != NO_TASK) {
+		if (*link == idx) {
+			*link = sleep_next[idx];
+			break;
+		}
+		link = sleep_next + *link;
+	}
+}
+
+void run_queue_sleep(uint8_t idx) {
+	uint32_t next_run = tasks[idx].next_run;
+	// Walk the list until the first task that wakes after this one.
+	// Tasks with the same wake up time stay in the order they were added.
+	uint8_t* link = &sleep_head;
+	while (*link != NO_TASK && !is_before(next_run, tasks[*link].next_run)) {
+		link = sleep_next + *link;
+	}
+	sleep_next[idx] = *link;
+	*link = idx;
+}
+
+void run_queue_wake_due() {
+	while (sleep_head != NO_TASK && is_time_past(tasks[sleep_head].next_run)) {
+		TRACE_EVENT(TRACE_WAKE, sleep_head);
+		set_ready(sleep_head, tasks[sleep_head].priority);
+		sleep_head = sleep_next[sleep_head];
+	}
+}
+
+uint8_t run_queue_pop() {
+	if (ready_levels == 0) {
+		return NO_TASK;
+	}
+	// Find the highest priority level with a ready task.
+	uint8_t priority = NUM_PRIORITIES - 1;
+	while (!(ready_levels & (1 << priority))) {
+		priority--;
+	}
+	// Within a level, prefer the tasks after the last one that ran so that every ready task gets a turn.
+	task_mask_t mask = ready_mask[priority];
+	if (task_idx < MAX_LD_TASKS) {
+		task_mask_t later = mask & (task_mask_t)(((task_mask_t)~(task_mask_t)0 << task_idx) << 1);
+		if (later) {
+			mask = later;
+		}
+	}
+	uint8_t idx = __builtin_ctz(mask);
+	clear_ready(idx, priority);
+	return idx;
+}
+
+bool run_queue_has_ready() {
+	return ready_levels != 0;
+}
+
+bool run_queue_next_wake(uint32_t* wake_time) {
+	if (sleep_head == NO_TASK) {
+		return false;
+	}
+	*wake_time = tasks[sleep_head].next_run;
+	return true;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+#if MAX_LD_TASKS > 16
+	#error "The run queue bitmap supports at most 16 loadable tasks."
+#endif
+
+#if NUM_PRIORITIES > 8
+	#error "The run queue supports at most 8 priority levels."
+#endif
+
+// One bit per task. Use the smallest type that fits so the AVR doesn't need to do 16 bit operations when it
+// doesn't need to.
+#if MAX_LD_TASKS > 8
+typedef uint16_t task_mask_t;
+#else
+typedef uint8_t task_mask_t;
+#endif
+
+#define TASK_BIT(idx) ((task_mask_t)1 << (idx))
+
+// Returned by run_queue_pop when no task is ready to run.
+#define NO_TASK 0xFF
+
+// The tasks are either in the ready bitmap for their priority, in the sleep queue sorted by next_run, blocked,
+// or in none of these if they are disabled. Picking the next task to run only needs to look at the ready bitmaps, and checking
+// for wake ups only needs to look at the head of the sleep queue.
+
+// Clear the ready bitmap and the sleep queue.
+void run_queue_init();
+
+// Insert a task into the sleep queue based on its next_run time.
+// The task will move to the ready bitmap once that time has passed.
+void run_queue_sleep(uint8_t idx);
+
+// Add a task directly to the ready bitmap. Used when a task is preempted or unblocked.
+void run_queue_ready(uint8_t idx);
+
+// Make the highest priority task in waiters ready and remove it from waiters.
+// Returns the task woken, or NO_TASK if waiters is empty.
+uint8_t run_queue_wake_one(task_mask_t* waiters);
+
+// Mark the running task as blocked so the kernel doesn't add it to the sleep queue when it suspends.
+// It stays off the run queue until run_queue_ready is called for it.
+void run_queue_block(uint8_t idx);
+
+// Returns true if the task is blocked.
+bool run_queue_is_blocked(uint8_t idx);
+
+// Change the effective priority of a task, moving it between ready bitmaps if it's ready.
+// Task priorities must only be changed through this function while the task is enabled.
+void run_queue_set_priority(uint8_t idx, uint8_t priority);
+
+// Take a task out of the ready bitmap, sleep queue, and blocked set. Used when a task is disabled or deleted.
+void run_queue_remove(uint8_t idx);
+
+// Move the tasks at the head of the sleep queue whose next_run has passed to the ready bitmap.
+void run_queue_wake_due();
+
+// Get the next task to run and remove it from the ready bitmap, or NO_TASK if nothing is ready.
+// The highest priority ready task is picked. Tasks with the same priority are picked round robin starting after
+// the last task that ran.
+uint8_t run_queue_pop();
+
+// Returns true if there are tasks in the ready bitmap.
+bool run_queue_has_ready();
+
+// Get the next_run of the task at the head of the sleep queue.
+// Returns false if no tasks are sleeping.
+bool run_queue_next_wake(uint32_t* wake_time);
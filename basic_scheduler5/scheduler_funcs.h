@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 
+#include "config.h"
+
 // This is the set of "SystemCalls" tasks will have access to.
 // The functions are defined in the main scheduler build.
 struct SchedulerFuncs {
@@ -14,9 +16,41 @@ struct SchedulerFuncs {
 	uint8_t (*usart_write_free)();
 	uint8_t (*usart_read)(void*, uint8_t);
 	const char* (*get_task_name)(uint8_t*);
+	// Timer1 ticks (4us) extended to 32 bits.
+	uint32_t (*get_time)(void);
+	void (*delay_ticks)(uint32_t);
+	// Sleep until an absolute get_time value. Useful for periodic tasks that shouldn't drift.
+	void (*sleep_until)(uint32_t);
+	// A table of mutexes indexed 0 to NUM_LOCKS - 1. Lock 0 is the one used by get_lock.
+	// A task waiting on a lock doesn't run again until the lock is handed to it.
+	void (*mutex_lock)(uint8_t);
+	bool (*mutex_try_lock)(uint8_t);
+	void (*mutex_unlock)(uint8_t);
+	// Message queues indexed 0 to NUM_QUEUES - 1. Every message is exactly QUEUE_MSG_SIZE bytes.
+	// The try_ versions return false instead of blocking if the queue is full/empty.
+	bool (*queue_try_send)(uint8_t, const void*);
+	void (*queue_send)(uint8_t, const void*);
+	bool (*queue_try_receive)(uint8_t, void*);
+	void (*queue_receive)(uint8_t, void*);
+	// Wait until one of the events in the mask is set for this task, or the timeout (in ticks) passes.
+	// A timeout of 0 waits forever. Returns the events that were set, or 0 on a timeout.
+	// EVENT_USART_RX is set while this task has unread UART data.
+	uint8_t (*wait_event)(uint8_t, uint32_t);
+	// Set events for the task in the given slot, waking it if it's waiting on them.
+	void (*post_event)(uint8_t, uint8_t);
+	// Read the UART data in place instead of copying it out with usart_read. usart_peek points at the oldest
+	// unread byte and returns how many follow it before the receive buffer wraps, and usart_commit drops bytes
+	// once the task is done with them. The data is only valid until it's committed.
+	uint8_t (*usart_peek)(const uint8_t**);
+	void (*usart_commit)(uint8_t);
 };
 
 // .scheduler_funcs needs to be set to the same value in the scheduler build, and the linking of each task.
+// The RAM is split up like this:
+// * 0x100-0x43F: The kernel's .data and .bss, 832 bytes. The Makefile checks they end before this table.
+// * 0x440-0x46B: This table.
+// * 0x46C-0x4FF: The kernel stack, 148 bytes. The deepest kernel call chains (a command handler called from the
+//   main loop with an interrupt on top) use about 110 bytes.
 __attribute__((__section__(".scheduler_funcs")))
 struct SchedulerFuncs scheduler;
 
@@ -4,41 +4,74 @@
  * Created: 6/5/2022 8:44:56 AM
  *  Author: feros
  */ 
-#include "serial.h"
-#include <avr/boot.h>
+#include <string.h>
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
+#include "config.h"
+#include "hal.h"
+#include "serial.h"
+#include "slip.h"
+#include "trace.h"
 
-#ifndef F_CPU
-	#define F_CPU 16000000
-#endif
-// This controls how many independent threads can have their reads tracked.
+// This controls how many receive channels there are. Channel 0 is for the kernel, and the rest are for the tasks.
 #ifndef MAX_TASKS
 	#define MAX_TASKS 5
 #endif
 // The size of the shared transmit buffer.
 #ifndef TX_BUFFER_LEN
-	#define TX_BUFFER_LEN 128
+	#define TX_BUFFER_LEN 64
 #endif
-// The max depth of the receive queue for the slowest task.
-#ifndef RX_BUFFER_LEN
-	#define RX_BUFFER_LEN 16
+// The size of the receive buffer for channel 0.
+#ifndef RX_CMD_BUFFER_LEN
+	#define RX_CMD_BUFFER_LEN 32
 #endif
+// The size of the receive buffer for each of the other channels is RX_BUFFER_LEN in config.h, since the tasks need
+// it to know how much they can read at once.
+
+// Where each channel's receive buffer is in serial_rx_buffer.
+#define RX_CHANNEL_START(channel) ((channel) == 0 ? 0 : RX_CMD_BUFFER_LEN + ((channel) - 1) * RX_BUFFER_LEN)
+#define RX_CHANNEL_CAPACITY(channel) ((channel) == 0 ? RX_CMD_BUFFER_LEN : RX_BUFFER_LEN)
+
+// Received data is framed like SLIP (RFC 1055) with the first byte of each packet giving the channel.
+// A packet is: SLIP_END, channel, data..., SLIP_END. SLIP_END and SLIP_ESC are escaped in the channel and data.
+
+// The ring buffer indexes wrap with a mask instead of a division when the buffer size is a power of two. The sizes
+// are compile time constants, so only one of the paths is built.
+#define IS_POWER_OF_2(n) (((n) & ((n) - 1)) == 0)
+#define TX_POWER_OF_2 IS_POWER_OF_2(TX_BUFFER_LEN)
+// The channel picks the receive buffer size at run time, so both have to be powers of two for the mask.
+#define RX_POWER_OF_2 (IS_POWER_OF_2(RX_CMD_BUFFER_LEN) && IS_POWER_OF_2(RX_BUFFER_LEN))
+
+// Keeps the compiler from moving the buffer copies past the index update that hands the space over to the ISR.
+#define MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
 
 /** 
  * Increment a circular buffer pointer with rollover.
  */
-static inline uint8_t IncrementWithRollover(uint8_t val, uint8_t capacity) {
-	return (val + 1) % capacity;
+static inline uint8_t IncrementWithRollover(uint8_t val, uint8_t capacity, bool power_of_2) {
+	if (power_of_2) {
+		return (val + 1) & (capacity - 1);
+	}
+	val++;
+	return val == capacity ? 0 : val;
+}
+
+/** 
+ * Get the number of bytes in a circular buffer.
+ */
+static inline uint8_t RingBufferUsed(uint8_t head, uint8_t tail, uint8_t capacity, bool power_of_2) {
+	if (power_of_2) {
+		return (uint8_t)(head - tail) & (capacity - 1);
+	}
+	return tail <= head ? head - tail : head + (capacity - tail);
 }
 
 /** 
  * Push a value into a circular buffer and update the buffer head pointer.
  * If the buffer is already full, data won't be inserted and false is returned.
  */
-static inline bool RingBufferPush (uint8_t data, uint8_t* head, uint8_t tail, uint8_t* buffer, uint8_t capacity) {
-	uint8_t next = IncrementWithRollover(*head, capacity);
+static inline bool RingBufferPush (uint8_t data, uint8_t* head, uint8_t tail, uint8_t* buffer, uint8_t capacity,
+                                   bool power_of_2) {
+	uint8_t next = IncrementWithRollover(*head, capacity, power_of_2);
 	// The ring has wrapped and the next value would overwrite the tail.
 	if (next == tail) {
 		return false;
@@ -52,131 +85,225 @@ static inline bool RingBufferPush (uint8_t data, uint8_t* head, uint8_t tail, ui
  * Read a value off a circular buffer and update the buffer tail pointer.
  * If the buffer is empty, data won't be read and false is returned.
  */
-static inline bool RingBufferPop (uint8_t* data, uint8_t head, uint8_t *tail, const uint8_t* buffer, uint8_t capacity) {
+static inline bool RingBufferPop (uint8_t* data, uint8_t head, uint8_t *tail, const uint8_t* buffer, uint8_t capacity,
+                                  bool power_of_2) {
 	// No data to pop.
 	if (head == *tail) {
 		return false;
 	}
 	*data = buffer[*tail];
-	*tail = IncrementWithRollover(*tail, capacity);
+	*tail = IncrementWithRollover(*tail, capacity, power_of_2);
 	return true;
 }
 
+/** 
+ * Copy len bytes into a circular buffer starting at head, in at most two pieces split at the end of the buffer.
+ * The caller has to check there's space. Returns the new head.
+ */
+static inline uint8_t RingBufferWrite (uint8_t* buffer, uint8_t head, const uint8_t* data, uint8_t len,
+                                       uint8_t capacity) {
+	uint8_t to_end = capacity - head;
+	if (len < to_end) {
+		memcpy(buffer + head, data, len);
+		return head + len;
+	}
+	memcpy(buffer + head, data, to_end);
+	memcpy(buffer, data + to_end, len - to_end);
+	return len - to_end;
+}
+
+/** 
+ * Copy len bytes out of a circular buffer starting at tail, in at most two pieces split at the end of the buffer.
+ * The caller has to check there's enough data. Returns the new tail.
+ */
+static inline uint8_t RingBufferRead (uint8_t* data, uint8_t tail, const uint8_t* buffer, uint8_t len,
+                                      uint8_t capacity) {
+	uint8_t to_end = capacity - tail;
+	if (len < to_end) {
+		memcpy(data, buffer + tail, len);
+		return tail + len;
+	}
+	memcpy(data, buffer + tail, to_end);
+	memcpy(data + to_end, buffer, len - to_end);
+	return len - to_end;
+}
+
 // This buffer should be interrupt safe since the IRQ and main execution don't touch the same variables and since the values are read atomically.
 // The USART_Send updates the head and buffer value, and the IRQ updates the tail.
-static uint8_t serial_tx_head = 0;
+static volatile uint8_t serial_tx_head = 0;
 static volatile uint8_t serial_tx_tail = 0;
 static volatile uint8_t serial_tx_buffer[TX_BUFFER_LEN];
 
-// This buffer should be interrupt safe since the IRQ and main execution don't touch the same variables and since the values are read atomically.
+// These buffers should be interrupt safe since the IRQ and main execution don't touch the same variables and since the values are read atomically.
 // The IRQ updates the head, error, and buffer values. USART_read updates the tail.
-// The reads are tracked independently for each task, but they share a single buffer.
-static volatile uint8_t serial_rx_head = 0;
-static uint8_t serial_rx_tail[MAX_TASKS] = {0};
+// Each channel has its own section of serial_rx_buffer, so a slow reader can only lose its own data.
+static volatile uint8_t serial_rx_head[MAX_TASKS] = {0};
+static volatile uint8_t serial_rx_tail[MAX_TASKS] = {0};
 // Could be bit mask
 static volatile bool serial_rx_error[MAX_TASKS] = {0};
-static volatile uint8_t serial_rx_buffer[RX_BUFFER_LEN];
+static volatile uint8_t serial_rx_buffer[RX_CMD_BUFFER_LEN + (MAX_TASKS - 1) * RX_BUFFER_LEN];
+// The channel of the packet being received by the IRQ.
+#define RX_CHANNEL_NEXT 0xFE
+#define RX_CHANNEL_DROP 0xFF
+static uint8_t serial_rx_channel = RX_CHANNEL_DROP;
+// Set if the last byte received was SLIP_ESC.
+static bool serial_rx_escape = false;
+// Set by the IRQ when a byte is received so the scheduler can wake the tasks waiting on data.
+static volatile bool serial_rx_event = false;
 
 
 void USART_Init (uint32_t baud)
 {
-	/* Set baud rate */
-	// UBRR = F_OSC/(8 * baud) - 1
-	// For 16MHz and 115200 baud = 16.36. 16 gives rate 117647.
-	// Add 0.5 to apply rounding.
-	// Much more efficient to do this without floating point eventually.
-	uint16_t ubbr_calc = ((double)F_CPU) / (8.0 * (double)baud) - 1.0 + 0.5;
-	//uint16_t ubbr_calc = 16;
-	UBRR0L = ubbr_calc;
-	/* Enable double rate clock gen */
-	UCSR0A = (1<<U2X0);
-	//Enable receiver and transmitter and Rx interrupt.
-	//Since the Tx ready interrupt triggers continuously if nothing is being sent, it will only be enabled during writes.
-	UCSR0B = (1<<RXCIE0)|(1<<RXEN0)|(1<<TXEN0);
-	/* Set frame format: 8data*/
-	UCSR0C = (3<<UCSZ00);
+	hal_uart_init(baud);
 }
 
 uint8_t USART_Send(const void* data, uint8_t len) {
-	uint8_t ret = 0;
+	uint8_t head = serial_tx_head;
+	// The IRQ only frees up space, so at least this much stays free. One byte is always left empty so a full buffer
+	// can be told apart from an empty one.
+	uint8_t space = TX_BUFFER_LEN - 1 - RingBufferUsed(head, serial_tx_tail, TX_BUFFER_LEN, TX_POWER_OF_2);
 	// Add data unless the buffer is full.
-	for (uint8_t i = 0; i < len; i++) {
-		if (!RingBufferPush(((uint8_t*)data)[i], &serial_tx_head, serial_tx_tail, (uint8_t*)serial_tx_buffer, TX_BUFFER_LEN)) {
-			break;
-		}
-		ret++;
+	if (len > space) {
+		len = space;
 	}
+	head = RingBufferWrite((uint8_t*)serial_tx_buffer, head, data, len, TX_BUFFER_LEN);
+	MEMORY_BARRIER();
+	serial_tx_head = head;
 	/* Enable interrupt to push out data when ready. */
-	UCSR0B |= 1<<UDRIE0;
-	return ret;
+	hal_uart_tx_irq(true);
+	return len;
 }
 
-uint8_t USART_Read(uint8_t task_idx, void* data, uint8_t len) {
-	uint8_t ret = 0;
+uint8_t USART_Read(uint8_t channel, void* data, uint8_t len) {
+	uint8_t* buffer = (uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel);
+	uint8_t capacity = RX_CHANNEL_CAPACITY(channel);
+	uint8_t tail = serial_rx_tail[channel];
+	// The IRQ only adds data, so at least this much stays available.
+	uint8_t used = RingBufferUsed(serial_rx_head[channel], tail, capacity, RX_POWER_OF_2);
 	// Read off available data that fits in the output buffer.
-	for (uint8_t i = 0; i < len; i++) {
-		if(!RingBufferPop(((uint8_t*)data) + i, serial_rx_head, serial_rx_tail + task_idx, (uint8_t*)serial_rx_buffer, RX_BUFFER_LEN)) {
-			break;
-		}
-		ret++;
+	if (len > used) {
+		len = used;
 	}
-	return ret;
+	tail = RingBufferRead(data, tail, buffer, len, capacity);
+	MEMORY_BARRIER();
+	serial_rx_tail[channel] = tail;
+	return len;
 }
 
-bool Check_New_Error(uint8_t task_idx) {
-	if (serial_rx_error[task_idx]) {
-		serial_rx_error[task_idx] = false;
-		return true;
+uint8_t USART_Rx_Peek(uint8_t channel, const uint8_t** data) {
+	uint8_t tail = serial_rx_tail[channel];
+	uint8_t head = serial_rx_head[channel];
+	*data = (const uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel) + tail;
+	// Only the data up to the end of the buffer is contiguous.
+	if (tail <= head) {
+		return head - tail;
 	}
-	return false;
+	return RX_CHANNEL_CAPACITY(channel) - tail;
 }
 
-void USART_Rx_Clear(uint8_t task_idx) {
-	serial_rx_tail[task_idx] = serial_rx_head;
-	serial_rx_error[task_idx] = false;
+void USART_Rx_Commit(uint8_t channel, uint8_t len) {
+	uint8_t capacity = RX_CHANNEL_CAPACITY(channel);
+	uint8_t tail = serial_rx_tail[channel];
+	uint8_t used = RingBufferUsed(serial_rx_head[channel], tail, capacity, RX_POWER_OF_2);
+	// Don't let a bad length move the tail past the data.
+	if (len > used) {
+		len = used;
+	}
+	tail += len;
+	if (tail >= capacity) {
+		tail -= capacity;
+	}
+	// The reader has to be done with the data before the IRQ can reuse the space.
+	MEMORY_BARRIER();
+	serial_rx_tail[channel] = tail;
 }
 
-uint8_t USART_Rx_Bytes_Buffered(uint8_t task_idx) {
-	// Avoid race condition where head is updated during call.
-	uint8_t local_head = serial_rx_head;
-	if (serial_rx_tail[task_idx] <= local_head) {
-		return local_head - serial_rx_tail[task_idx];
+bool Check_New_Error(uint8_t channel) {
+	if (serial_rx_error[channel]) {
+		serial_rx_error[channel] = false;
+		return true;
 	}
-	// If head rolled over and tail hasn't
-	else {
-		return local_head + (RX_BUFFER_LEN - serial_rx_tail[task_idx]);
+	return false;
+}
+
+bool USART_Rx_Event() {
+	if (serial_rx_event) {
+		serial_rx_event = false;
+		return true;
 	}
+	return false;
+}
+
+bool USART_Rx_Event_Pending() {
+	return serial_rx_event;
+}
+
+void USART_Rx_Clear(uint8_t channel) {
+	serial_rx_tail[channel] = serial_rx_head[channel];
+	serial_rx_error[channel] = false;
+}
+
+uint8_t USART_Rx_Bytes_Buffered(uint8_t channel) {
+	return RingBufferUsed(serial_rx_head[channel], serial_rx_tail[channel], RX_CHANNEL_CAPACITY(channel),
+	                      RX_POWER_OF_2);
 }
 
 uint8_t USART_Tx_Free_Buffer() {
-	// Avoid race condition where tail is updated during call.
-	uint8_t local_tail = serial_tx_tail;
-	if (local_tail <= serial_tx_head) {
-		return TX_BUFFER_LEN - (serial_tx_head - local_tail);
-	}
-	// If head rolled over and tail hasn't
-	else {
-		return local_tail - serial_tx_head;
-	}
+	return TX_BUFFER_LEN - RingBufferUsed(serial_tx_head, serial_tx_tail, TX_BUFFER_LEN, TX_POWER_OF_2);
 }
 
 // Data Tx register empty interrupt.
-ISR(USART_UDRE_vect)
+HAL_ISR(USART_UDRE_vect)
 {
-	if(!RingBufferPop((uint8_t*)&UDR0, serial_tx_head, (uint8_t*)&serial_tx_tail, (uint8_t*)serial_tx_buffer, TX_BUFFER_LEN)) {
+	uint8_t data;
+	if (RingBufferPop(&data, serial_tx_head, (uint8_t*)&serial_tx_tail, (uint8_t*)serial_tx_buffer, TX_BUFFER_LEN,
+	                  TX_POWER_OF_2)) {
+		hal_uart_write(data);
+	} else {
 		/* Disable interrupt if no more data. */
-		UCSR0B &= ~(1<<UDRIE0);
+		hal_uart_tx_irq(false);
+		// Only the end of a burst is traced so the sent bytes don't fill the trace ring.
+		TRACE_EVENT(TRACE_UART_TX_DONE, 0);
 	}
 }
 
 // UART received byte interrupt.
-ISR(USART_RX_vect)
+// Decodes the SLIP framing and pushes the data into the buffer for the packet's channel.
+HAL_ISR(USART_RX_vect)
 {
-	uint8_t next = IncrementWithRollover(serial_rx_head, RX_BUFFER_LEN);
-	// Check if this push is going to overflow the buffer for any of the tasks.
-	for(uint8_t i = 0; i < MAX_TASKS; i++) {
-		serial_rx_error[i] = serial_rx_tail[i] == next;
+	uint8_t data = hal_uart_read();
+	TRACE_EVENT(TRACE_UART_RX, serial_rx_channel);
+	if (data == SLIP_END) {
+		// The next byte starts a new packet.
+		serial_rx_channel = RX_CHANNEL_NEXT;
+		serial_rx_escape = false;
+		return;
+	}
+	if (data == SLIP_ESC) {
+		serial_rx_escape = true;
+		return;
+	}
+	if (serial_rx_escape) {
+		serial_rx_escape = false;
+		if (data == SLIP_ESC_END) {
+			data = SLIP_END;
+		} else if (data == SLIP_ESC_ESC) {
+			data = SLIP_ESC;
+		}
+	}
+	
+	uint8_t channel = serial_rx_channel;
+	if (channel == RX_CHANNEL_NEXT) {
+		// Drop the rest of the packet if it's for a channel that doesn't exist.
+		serial_rx_channel = data < MAX_TASKS ? data : RX_CHANNEL_DROP;
+		return;
+	}
+	if (channel == RX_CHANNEL_DROP) {
+		return;
+	}
+	// Unlike the tx buffer, drop the data if the reader isn't keeping up.
+	if (!RingBufferPush(data, (uint8_t*)serial_rx_head + channel, serial_rx_tail[channel], (uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel), RX_CHANNEL_CAPACITY(channel), RX_POWER_OF_2)) {
+		serial_rx_error[channel] = true;
 	}
-	// Use serial_rx_head for tail since we always want this to go through.
-	RingBufferPush(UDR0, (uint8_t*)&serial_rx_head, serial_rx_head, (uint8_t*)serial_rx_buffer, RX_BUFFER_LEN);
+	serial_rx_event = true;
 }
@@ -23,16 +23,28 @@ void USART_Init (uint32_t baud);
 uint8_t USART_Send(const void* data, uint8_t len);
 
 /**
- * Read as much of the data as possible without blocking.
- * Each task_idx allows for separate tracking of which bytes have been read.
+ * Read as much of the data as possible from a receive channel without blocking.
+ * The host addresses each packet it sends to a channel, and each channel has its own buffer.
  * Returns the number of bytes read.
  */
-uint8_t USART_Read(uint8_t task_idx, void* data, uint8_t len);
+uint8_t USART_Read(uint8_t channel, void* data, uint8_t len);
 
 /**
- * Get the number of bytes waiting in the Rx buffer for this task_idx.
+ * Get the received data for a channel without copying it.
+ * Points data at the oldest unread byte in the channel's buffer and returns how many bytes follow it before the end
+ * of the buffer. If the data wraps around, the rest is returned by the next call after USART_Rx_Commit.
+ */
+uint8_t USART_Rx_Peek(uint8_t channel, const uint8_t** data);
+
+/**
+ * Drop len bytes from the start of a channel's buffer once the data from USART_Rx_Peek has been used.
+ */
+void USART_Rx_Commit(uint8_t channel, uint8_t len);
+
+/**
+ * Get the number of bytes waiting in the Rx buffer for this channel.
  */
-uint8_t USART_Rx_Bytes_Buffered(uint8_t task_idx);
+uint8_t USART_Rx_Bytes_Buffered(uint8_t channel);
 
 /**
  * Get the number of bytes waiting in the Rx buffer for this task_idx.
@@ -40,14 +52,25 @@ uint8_t USART_Rx_Bytes_Buffered(uint8_t task_idx);
 uint8_t USART_Tx_Free_Buffer();
 
 /**
- * Clear the read buffer for one of the tasks.
+ * Clear the read buffer for one of the channels.
+ */
+void USART_Rx_Clear(uint8_t channel);
+
+/**
+ * Check if any bytes were received since the last call.
+ * This clears the event if it was triggered.
+ */
+bool USART_Rx_Event();
+
+/**
+ * Check if any bytes were received since the last call to USART_Rx_Event without clearing the event.
  */
-void USART_Rx_Clear(uint8_t task_idx);
+bool USART_Rx_Event_Pending();
 
 /**
- * Check if a task isn't reading fast enough and dropped data.
+ * Check if a channel isn't being read fast enough and dropped data.
  * This clears the error if it was triggered. 
  */
-bool Check_New_Error(uint8_t task_idx);
+bool Check_New_Error(uint8_t channel);
 
 #endif /* INCFILE1_H_ */
\ No newline at end of file
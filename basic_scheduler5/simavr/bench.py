@@ -0,0 +1,119 @@
+"""Runs the kernel microbenchmarks under simavr and writes a JSON report.
+
+The report has the min, median and max cycles for each benchmark with the cost of the markers taken out, and the
+code size of the function it measures. Benchmarks named like USART_Send/16 move that many bytes per call and also
+report the cycles per byte. Those named like run_queue_pop:16 ran with that many task slots, from the firmware built
+from bench_run_queue.c for each number of tasks.
+
+python bench.py --runner ./bench_runner --elf ../build/bench.elf ../build/bench_run_queue_16.elf --report bench.json
+"""
+
+from argparse import ArgumentParser
+from collections import OrderedDict
+import json
+import os
+import statistics
+import subprocess
+
+# The symbol each benchmark measures, where it isn't the benchmark's name. The ring buffer helpers are inlined in the
+# kernel, so their size is that of the wrappers in bench_main.c.
+BENCH_SYMBOLS = {
+    'RingBufferPush': 'bench_ring_push',
+    'RingBufferPop': 'bench_ring_pop',
+    'USART_RX_vect': '__vector_18',
+    'USART_UDRE_vect': '__vector_19',
+}
+
+# The benchmark that only has the markers in it.
+OVERHEAD_BENCH = 'overhead'
+
+
+def run_benchmarks(runner, elf):
+    """Returns the cycles for the samples of each benchmark, in the order they ran."""
+    proc = subprocess.run([runner, elf], stdout=subprocess.PIPE, check=True)
+    samples = OrderedDict()
+    for line in proc.stdout.decode('ascii').splitlines():
+        (name, cycles) = line.rsplit(' ', 1)
+        samples.setdefault(name, []).append(int(cycles))
+    return samples
+
+
+def get_sizes(nm, elf):
+    """Returns the size of each function in the ELF.
+
+    The functions in helpers.s don't have their size recorded, so those go up to the next symbol.
+    """
+    proc = subprocess.run([nm, '--print-size', '--numeric-sort', elf], stdout=subprocess.PIPE, check=True)
+    symbols = []
+    for line in proc.stdout.decode('ascii').splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[2] in 'tT':
+            symbols.append((fields[3], int(fields[0], 16), int(fields[1], 16)))
+        elif len(fields) == 3 and fields[1] in 'tT':
+            symbols.append((fields[2], int(fields[0], 16), None))
+    sizes = {}
+    for (i, (name, addr, size)) in enumerate(symbols):
+        if size is None:
+            later = [a for (_, a, _) in symbols[i + 1:] if a > addr]
+            if not later:
+                continue
+            size = later[0] - addr
+        sizes[name] = size
+    return sizes
+
+
+def make_report(samples, sizes):
+    """Returns the cost of the markers and the report for each benchmark from one firmware."""
+    overhead = statistics.median_low(samples.pop(OVERHEAD_BENCH, [0]))
+    functions = OrderedDict()
+    for (name, cycles) in samples.items():
+        cycles = sorted(max(0, c - overhead) for c in cycles)
+        (function, _, task_count) = name.partition(':')
+        (function, _, byte_count) = function.partition('/')
+        entry = OrderedDict([
+            ('min', cycles[0]),
+            ('median', statistics.median_low(cycles)),
+            ('max', cycles[-1]),
+            ('samples', len(cycles)),
+            ('size', sizes.get(BENCH_SYMBOLS.get(function, function))),
+        ])
+        if byte_count:
+            entry['bytes'] = int(byte_count)
+            entry['cycles_per_byte'] = round(entry['median'] / int(byte_count), 1)
+        if task_count:
+            entry['tasks'] = int(task_count)
+        functions[name] = entry
+    return (overhead, functions)
+
+
+def print_report(report):
+    print(f'{"":24} {"min":>6} {"median":>6} {"max":>6} {"size":>6}')
+    for (name, entry) in report['functions'].items():
+        per_byte = f' {entry["cycles_per_byte"]:6.1f}/byte' if 'cycles_per_byte' in entry else ''
+        print(f'{name:24} {entry["min"]:6} {entry["median"]:6} {entry["max"]:6} {entry["size"] or "?":>6}{per_byte}')
+
+
+def main():
+    parser = ArgumentParser(description='Run the kernel microbenchmarks under simavr and write a JSON report.')
+    parser.add_argument('--runner', default='./bench_runner', help='The simavr runner built from bench_runner.c.')
+    parser.add_argument('--elf', nargs='+', default=['../build/bench.elf'],
+                        help='The benchmark firmware. The benchmarks from each are put in the same report.')
+    parser.add_argument('--report', help='Where to write the JSON report.')
+    parser.add_argument('--nm', default=os.environ.get('AVR_TOOL_PATH', '') + 'avr-nm',
+                        help='The avr-nm to get the function sizes with.')
+    args = parser.parse_args()
+
+    # The markers cost the same in each firmware, but they're measured in each one anyway.
+    report = OrderedDict([('overhead_cycles', OrderedDict()), ('functions', OrderedDict())])
+    for elf in args.elf:
+        (overhead, functions) = make_report(run_benchmarks(args.runner, elf), get_sizes(args.nm, elf))
+        report['overhead_cycles'][os.path.basename(elf)] = overhead
+        report['functions'].update(functions)
+    print_report(report)
+    if args.report:
+        with open(args.report, 'w') as fd:
+            json.dump(report, fd, indent=2)
+
+
+if __name__ == '__main__':
+    main()
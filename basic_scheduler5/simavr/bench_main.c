@@ -0,0 +1,238 @@
+// Microbenchmarks for the kernel hot paths, run by bench_runner under simavr. See bench.py.
+//
+// Each benchmark writes its name to GPIOR1 a character at a time, ending with 0. Then every sample writes 1 to
+// GPIOR0 when it starts and 0 when it stops, and the runner records the cycles in between. The overhead benchmark
+// measures the markers themselves so bench.py can take them out. The firmware sleeps with interrupts disabled when
+// it's done, which ends the simulation.
+//
+// serial.c is included rather than linked so the ring buffer helpers and the buffers can be reached. The timer1 and
+// UART interrupts are left disabled and the ISRs are called directly, so the numbers don't include the 7 or so
+// cycles for the interrupt to be taken and jump through the vector table.
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "dispatch.h"
+#include "syscalls.h"
+
+// Keep the public serial functions out of line so they run the same code as in the kernel.
+uint8_t USART_Send(const void* data, uint8_t len) __attribute__((noinline));
+uint8_t USART_Read(uint8_t channel, void* data, uint8_t len) __attribute__((noinline));
+uint8_t USART_Rx_Peek(uint8_t channel, const uint8_t** data) __attribute__((noinline));
+void USART_Rx_Commit(uint8_t channel, uint8_t len) __attribute__((noinline));
+
+#include "../serial.c"
+
+#define BENCH_SAMPLES 32
+// The most bytes moved by one call in the USART_Send and USART_Read benchmarks.
+#define BENCH_MAX_BYTES 16
+#define BENCH_STACK_SIZE 64
+
+#define BENCH_START() do { __asm__ __volatile__("" ::: "memory"); GPIOR0 = 1; } while (0)
+#define BENCH_STOP() do { GPIOR0 = 0; __asm__ __volatile__("" ::: "memory"); } while (0)
+
+// The kernel's stack pointer while a task runs. Referenced in assembly code.
+uint8_t* kernel_sp;
+
+static uint8_t bench_stack[BENCH_STACK_SIZE];
+static uint8_t bench_data[BENCH_MAX_BYTES];
+static volatile uint32_t bench_sink;
+
+void fault_task(uint8_t idx, uint8_t fault) {
+}
+
+static void bench_name(const char* name) {
+	do {
+		GPIOR1 = *name;
+	} while (*name++);
+}
+
+// The ring buffer helpers are always inlined in the kernel, so they're measured through these. The capacity is
+// passed in like USART_Read does for the receive channels. They aren't static so the compiler can't specialize them
+// for the capacity the benchmarks use.
+__attribute__((noinline)) bool bench_ring_push(uint8_t data, uint8_t* head, uint8_t tail, uint8_t* buffer,
+                                               uint8_t capacity) {
+	return RingBufferPush(data, head, tail, buffer, capacity, RX_POWER_OF_2);
+}
+
+__attribute__((noinline)) bool bench_ring_pop(uint8_t* data, uint8_t head, uint8_t* tail, const uint8_t* buffer,
+                                              uint8_t capacity) {
+	return RingBufferPop(data, head, tail, buffer, capacity, RX_POWER_OF_2);
+}
+
+// Each time it's started, the task stops the start_task sample and starts a suspend_task one.
+static void bench_task() {
+	while (1) {
+		BENCH_STOP();
+		bench_name("suspend_task");
+		BENCH_START();
+		suspend_task();
+	}
+}
+
+static void bench_switch() {
+	struct Task* task = tasks;
+	task->stack_start = bench_stack;
+	task->stack_size = BENCH_STACK_SIZE;
+	// The same initial stack as setup_start_func in main.c builds, with the entry point as the return address.
+	// The first start returns to the top of bench_task rather than out of suspend_task, which takes as long.
+	uint16_t word_addr = (uint16_t)bench_task;
+	task->stack_pointer = bench_stack + BENCH_STACK_SIZE - 1;
+	*task->stack_pointer-- = word_addr;
+	*task->stack_pointer-- = word_addr >> 8;
+	task->stack_pointer -= 18;
+	task_idx = 0;
+	current_task = task;
+
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		bench_name("start_task");
+		BENCH_START();
+		START_TASK();
+		BENCH_STOP();
+	}
+	// start_task and suspend_task enable interrupts.
+	cli();
+}
+
+static void bench_time() {
+	bench_name("get_time");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		BENCH_START();
+		bench_sink = get_time();
+		BENCH_STOP();
+	}
+	bench_name("is_time_past");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		uint32_t target = get_time() + i;
+		BENCH_START();
+		bench_sink = is_time_past(target);
+		BENCH_STOP();
+	}
+}
+
+static void bench_ring() {
+	uint8_t ring[RX_BUFFER_LEN];
+	uint8_t head = 0;
+	uint8_t tail = 0;
+	uint8_t data;
+	// The samples go all the way around the ring so the wrap is included.
+	bench_name("RingBufferPush");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		BENCH_START();
+		bench_ring_push(i, &head, tail, ring, RX_BUFFER_LEN);
+		BENCH_STOP();
+		bench_ring_pop(&data, head, &tail, ring, RX_BUFFER_LEN);
+	}
+	bench_name("RingBufferPop");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		bench_ring_push(i, &head, tail, ring, RX_BUFFER_LEN);
+		BENCH_START();
+		bench_ring_pop(&data, head, &tail, ring, RX_BUFFER_LEN);
+		BENCH_STOP();
+	}
+}
+
+static void bench_send(const char* name, uint8_t len) {
+	bench_name(name);
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		// Start from an empty buffer, but at a different place each time.
+		serial_tx_tail = serial_tx_head;
+		BENCH_START();
+		USART_Send(bench_data, len);
+		BENCH_STOP();
+	}
+	hal_uart_tx_irq(false);
+	serial_tx_tail = serial_tx_head;
+}
+
+static void bench_read(const char* name, uint8_t len) {
+	uint8_t channel = 0;
+	bench_name(name);
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		for (uint8_t j = 0; j < len; j++) {
+			RingBufferPush(j, (uint8_t*)serial_rx_head + channel, serial_rx_tail[channel],
+			               (uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel), RX_CHANNEL_CAPACITY(channel),
+			               RX_POWER_OF_2);
+		}
+		BENCH_START();
+		USART_Read(channel, bench_data, len);
+		BENCH_STOP();
+	}
+}
+
+// The zero copy reads, with len bytes waiting each time.
+static void bench_peek(uint8_t len) {
+	uint8_t channel = 0;
+	const uint8_t* data;
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		for (uint8_t j = 0; j < len; j++) {
+			RingBufferPush(j, (uint8_t*)serial_rx_head + channel, serial_rx_tail[channel],
+			               (uint8_t*)serial_rx_buffer + RX_CHANNEL_START(channel), RX_CHANNEL_CAPACITY(channel),
+			               RX_POWER_OF_2);
+		}
+		bench_name("USART_Rx_Peek");
+		BENCH_START();
+		uint8_t available = USART_Rx_Peek(channel, &data);
+		BENCH_STOP();
+		bench_name("USART_Rx_Commit");
+		BENCH_START();
+		USART_Rx_Commit(channel, available);
+		BENCH_STOP();
+		USART_Rx_Clear(channel);
+	}
+}
+
+static void bench_isrs() {
+	// A data byte for channel 1, which is the common case.
+	bench_name("USART_RX_vect");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		serial_rx_channel = 1;
+		USART_Rx_Clear(1);
+		BENCH_START();
+		USART_RX_vect();
+		BENCH_STOP();
+		// reti enables interrupts.
+		cli();
+	}
+	USART_Rx_Clear(1);
+
+	// Sending a byte from the buffer.
+	bench_name("USART_UDRE_vect");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		USART_Send(bench_data, 1);
+		// Keep the real interrupt from firing after reti.
+		hal_uart_tx_irq(false);
+		BENCH_START();
+		USART_UDRE_vect();
+		BENCH_STOP();
+		cli();
+	}
+}
+
+int main(void) {
+	// Timer1 runs for get_time, but without the overflow interrupt.
+	TCCR1B = (1 << CS11) | (1 << CS10);
+	USART_Init(115200);
+	UCSR0B &= ~(1 << RXCIE0);
+
+	bench_name("overhead");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		BENCH_START();
+		BENCH_STOP();
+	}
+	bench_switch();
+	bench_time();
+	bench_ring();
+	bench_send("USART_Send/1", 1);
+	bench_send("USART_Send/16", BENCH_MAX_BYTES);
+	bench_read("USART_Read/1", 1);
+	bench_read("USART_Read/16", BENCH_MAX_BYTES);
+	bench_peek(BENCH_MAX_BYTES);
+	bench_isrs();
+
+	// Sleeping with interrupts disabled ends the simulation.
+	cli();
+	sleep_mode();
+	return 0;
+}
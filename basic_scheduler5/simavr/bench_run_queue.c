@@ -0,0 +1,135 @@
+// Benchmarks for the run queue with more task slots than the kernel has RAM for, run by bench_runner under simavr
+// with the same markers as bench_main.c. This is built with only run_queue.c, once for each of 4, 8 and 16 loadable
+// tasks, so bench.py can show how picking, waking and sleeping a task scales with the number of tasks. The names
+// end with the number of tasks, like run_queue_pop:16.
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "hal.h"
+#include "run_queue.h"
+#include "syscalls.h"
+
+#define BENCH_SAMPLES 32
+
+#define BENCH_START() do { __asm__ __volatile__("" ::: "memory"); GPIOR0 = 1; } while (0)
+#define BENCH_STOP() do { GPIOR0 = 0; __asm__ __volatile__("" ::: "memory"); } while (0)
+
+// A tick well past the end of the benchmarks, for the tasks that shouldn't wake.
+#define FAR_FUTURE 0x10000
+
+// Used by run_queue.c. Defined in dispatch.c in the kernel.
+struct Task tasks[MAX_LD_TASKS];
+uint8_t task_idx = NO_TASK;
+
+// The same as get_time in syscalls.c, which can't be linked without the rest of the kernel. The overflow interrupt
+// isn't enabled since the benchmarks finish well within one period of timer1.
+static volatile uint16_t timer1_overflows = 0;
+
+uint32_t get_time() {
+	uint16_t low;
+	uint16_t high;
+	HAL_ATOMIC {
+		low = hal_timer1_read();
+		high = timer1_overflows;
+		if (hal_timer1_overflow_pending() && low < 0x8000) {
+			high++;
+		}
+	}
+	return ((uint32_t)high << 16) | low;
+}
+
+bool is_time_past(uint32_t target_time) {
+	return (int32_t)(target_time - get_time()) < 0;
+}
+
+static void bench_write(const char* name) {
+	do {
+		GPIOR1 = *name;
+	} while (*name++);
+}
+
+static void bench_name(const char* name) {
+	while (*name) {
+		GPIOR1 = *name++;
+	}
+	GPIOR1 = ':';
+	if (MAX_LD_TASKS >= 10) {
+		GPIOR1 = '0' + MAX_LD_TASKS / 10;
+	}
+	GPIOR1 = '0' + MAX_LD_TASKS % 10;
+	GPIOR1 = 0;
+}
+
+// Every task is ready at the same priority, so the round robin mask is used each time.
+static void bench_pop() {
+	run_queue_init();
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		run_queue_ready(i);
+	}
+	bench_name("run_queue_pop");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		BENCH_START();
+		task_idx = run_queue_pop();
+		BENCH_STOP();
+		run_queue_ready(task_idx);
+	}
+}
+
+// Every task is sleeping and the one at the head is due, which is what the dispatch loop finds after a tick.
+static void bench_wake_due() {
+	run_queue_init();
+	for (uint8_t i = 1; i < MAX_LD_TASKS; i++) {
+		tasks[i].next_run = get_time() + FAR_FUTURE;
+		run_queue_sleep(i);
+	}
+	bench_name("run_queue_wake_due");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		tasks[0].next_run = get_time() - 1;
+		run_queue_sleep(0);
+		BENCH_START();
+		run_queue_wake_due();
+		BENCH_STOP();
+		run_queue_pop();
+	}
+}
+
+// Every other task is sleeping and the new one wakes after all of them, so the whole sleep queue is walked.
+static void bench_sleep() {
+	run_queue_init();
+	for (uint8_t i = 1; i < MAX_LD_TASKS; i++) {
+		tasks[i].next_run = get_time() + FAR_FUTURE;
+		run_queue_sleep(i);
+	}
+	bench_name("run_queue_sleep");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		tasks[0].next_run = get_time() + 2 * FAR_FUTURE;
+		BENCH_START();
+		run_queue_sleep(0);
+		BENCH_STOP();
+		run_queue_remove(0);
+	}
+}
+
+int main(void) {
+	// Timer1 runs for get_time like in the kernel, but without the overflow interrupt.
+	TCCR1B = (1 << CS11) | (1 << CS10);
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		tasks[i].priority = 0;
+	}
+
+	bench_write("overhead");
+	for (uint8_t i = 0; i < BENCH_SAMPLES; i++) {
+		BENCH_START();
+		BENCH_STOP();
+	}
+	bench_pop();
+	bench_wake_due();
+	bench_sleep();
+
+	// Sleeping with interrupts disabled ends the simulation.
+	cli();
+	sleep_mode();
+	return 0;
+}
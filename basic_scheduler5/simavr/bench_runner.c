@@ -0,0 +1,95 @@
+// Runs the microbenchmarks from bench_main.c under simavr and prints a line with the name and the cycles for each
+// sample. See bench_main.c for how the firmware marks the samples.
+// Usage: bench_runner BENCH_ELF
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_uart.h"
+
+// The data space addresses of the registers the firmware writes the markers to.
+#define GPIOR0_ADDR 0x3E
+#define GPIOR1_ADDR 0x4A
+
+#ifndef F_CPU
+	#define F_CPU 16000000
+#endif
+
+static char bench_name[32] = "";
+static uint8_t bench_name_len = 0;
+static bool name_done = true;
+static bool sample_started = false;
+static avr_cycle_count_t sample_start = 0;
+
+static void marker_write(struct avr_t* avr, avr_io_addr_t addr, uint8_t value, void* param) {
+	if (value) {
+		sample_started = true;
+		sample_start = avr->cycle;
+	} else if (sample_started) {
+		sample_started = false;
+		printf("%s %llu\n", bench_name, (unsigned long long)(avr->cycle - sample_start));
+	}
+}
+
+static void name_write(struct avr_t* avr, avr_io_addr_t addr, uint8_t value, void* param) {
+	// A write after the end of a name starts the next one.
+	if (name_done) {
+		bench_name_len = 0;
+		name_done = false;
+	}
+	if (value == 0 || bench_name_len == sizeof(bench_name) - 1) {
+		name_done = value == 0;
+		bench_name[bench_name_len] = 0;
+		return;
+	}
+	bench_name[bench_name_len++] = value;
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s BENCH_ELF\n", argv[0]);
+		return 1;
+	}
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[1], &firmware)) {
+		fprintf(stderr, "Couldn't read %s\n", argv[1]);
+		return 1;
+	}
+	avr_t* avr = avr_make_mcu_by_name("atmega168");
+	if (!avr) {
+		fprintf(stderr, "simavr doesn't support the atmega168\n");
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	if (!avr->frequency) {
+		avr->frequency = F_CPU;
+	}
+
+	// The UART output is only there because the ISRs are run, so don't print it.
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	avr_register_io_write(avr, GPIOR0_ADDR, marker_write, NULL);
+	avr_register_io_write(avr, GPIOR1_ADDR, name_write, NULL);
+
+	int state = cpu_Running;
+	while (state != cpu_Done && state != cpu_Crashed) {
+		state = avr_run(avr);
+	}
+	avr_terminate(avr);
+	if (state == cpu_Crashed) {
+		fprintf(stderr, "The benchmarks crashed.\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,155 @@
+// Runs the kernel under simavr with its UART connected to stdin and stdout, so scenarios.py can drive it with the
+// same protocol client.py uses with the board.
+// Usage: harness FIRMWARE_ELF
+//
+// Bytes written to stdin are fed to the UART as fast as the simulated UART takes them. Everything on stdout is an
+// event record, so the driver knows the cycle each byte crossed the UART at:
+//   char type, uint8_t value, uint64_t cycle (little endian)
+// The types are EVENT_TX for a byte sent by the kernel, EVENT_RX for a byte handed to the kernel's UART,
+// EVENT_SLEEP when the kernel goes to sleep (value 1) or wakes up (value 0), and EVENT_EXIT when the simulation stops,
+// with the simavr state as the value.
+
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_irq.h"
+#include "avr_uart.h"
+
+#define EVENT_TX 'T'
+#define EVENT_RX 'R'
+#define EVENT_SLEEP 'S'
+#define EVENT_EXIT 'X'
+
+#ifndef F_CPU
+	#define F_CPU 16000000
+#endif
+
+// How often stdin is checked for more input. A byte takes about 1400 cycles at 115200 baud, so this keeps the UART
+// busy without polling on every instruction.
+#define INPUT_POLL_CYCLES 256
+
+static avr_t* avr;
+static avr_irq_t* uart_input;
+
+// The simulated UART has a small FIFO and raises XOFF when it's full.
+static bool uart_xon = true;
+static uint8_t input_buf[256];
+static size_t input_len = 0;
+static size_t input_pos = 0;
+static bool input_closed = false;
+
+static void write_event(char type, uint8_t value) {
+	uint8_t record[10];
+	uint64_t cycle = avr->cycle;
+	record[0] = type;
+	record[1] = value;
+	for (uint8_t i = 0; i < 8; i++) {
+		record[2 + i] = cycle >> (8 * i);
+	}
+	if (fwrite(record, sizeof(record), 1, stdout) != 1) {
+		// The driver went away.
+		exit(0);
+	}
+	fflush(stdout);
+}
+
+static void uart_output_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	write_event(EVENT_TX, value);
+}
+
+static void uart_xon_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	uart_xon = true;
+}
+
+static void uart_xoff_hook(struct avr_irq_t* irq, uint32_t value, void* param) {
+	uart_xon = false;
+}
+
+// Read whatever is available on stdin without blocking the simulation.
+static void poll_input() {
+	if (input_pos < input_len || input_closed) {
+		return;
+	}
+	struct pollfd fd = {.fd = STDIN_FILENO, .events = POLLIN};
+	if (poll(&fd, 1, 0) <= 0) {
+		return;
+	}
+	ssize_t len = read(STDIN_FILENO, input_buf, sizeof(input_buf));
+	if (len <= 0) {
+		input_closed = len == 0 || errno != EINTR;
+		return;
+	}
+	input_len = len;
+	input_pos = 0;
+}
+
+static void feed_uart() {
+	while (uart_xon && input_pos < input_len) {
+		uint8_t value = input_buf[input_pos++];
+		avr_raise_irq(uart_input, value);
+		write_event(EVENT_RX, value);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FIRMWARE_ELF\n", argv[0]);
+		return 1;
+	}
+
+	elf_firmware_t firmware;
+	memset(&firmware, 0, sizeof(firmware));
+	if (elf_read_firmware(argv[1], &firmware)) {
+		fprintf(stderr, "Couldn't read %s\n", argv[1]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name("atmega168");
+	if (!avr) {
+		fprintf(stderr, "simavr doesn't support the atmega168\n");
+		return 1;
+	}
+	avr_init(avr);
+	avr_load_firmware(avr, &firmware);
+	// The kernel doesn't record its clock in the ELF.
+	if (!avr->frequency) {
+		avr->frequency = F_CPU;
+	}
+
+	// Stop simavr printing the UART output itself, since stdout is only for events.
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('0'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('0'), &flags);
+
+	uart_input = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_INPUT);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUTPUT), uart_output_hook, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XON), uart_xon_hook, NULL);
+	avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('0'), UART_IRQ_OUT_XOFF), uart_xoff_hook, NULL);
+
+	int state = cpu_Running;
+	bool sleeping = false;
+	avr_cycle_count_t next_poll = 0;
+	while (state != cpu_Done && state != cpu_Crashed) {
+		state = avr_run(avr);
+		if ((state == cpu_Sleeping) != sleeping) {
+			sleeping = !sleeping;
+			write_event(EVENT_SLEEP, sleeping);
+		}
+		if (avr->cycle >= next_poll) {
+			next_poll = avr->cycle + INPUT_POLL_CYCLES;
+			poll_input();
+			feed_uart();
+		}
+	}
+	write_event(EVENT_EXIT, state);
+	avr_terminate(avr);
+	return state == cpu_Done ? 0 : 1;
+}
@@ -0,0 +1,428 @@
+"""Runs scripted scenarios against the kernel in the simavr harness and checks their cycle counts.
+
+The harness reports the cycle each byte crosses the simulated UART at, so every step is measured from the first byte
+of the command reaching the kernel to the last byte of its response. The counts are compared with a baseline so a
+change that makes the kernel slower fails the check.
+
+Besides loading and running a task, the scenarios measure how much of the time the kernel is awake while its tasks
+wait, how long a high priority task takes to respond while a lower one holds its lock, the queue throughput, and
+with --preemptive-firmware, that a task that never yields doesn't stop the kernel answering. The steps that are
+repeated keep all their samples in the results, but only the median is compared, since where the input lands
+against the tasks depends on the wall time and so the slowest sample varies from run to run.
+
+python scenarios.py --harness ./harness --firmware ../build/basic_scheduler5.elf --tasks ../build \
+    --preemptive-firmware ../build/preemptive/basic_scheduler5.elf
+"""
+
+from argparse import ArgumentParser
+import json
+import os
+import queue
+import statistics
+import struct
+import subprocess
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'python'))
+from client import DeviceLink, CmdError, send_packet, get_task_list, load_task, enable_task, del_task  # noqa: E402
+
+# The records written by the harness. See harness.c.
+event_format = '<cBQ'
+event_size = struct.calcsize(event_format)
+EVENT_TX = b'T'
+EVENT_RX = b'R'
+EVENT_SLEEP = b'S'
+EVENT_EXIT = b'X'
+
+F_CPU = 16000000
+
+# task6 prints the average of its input once it has a full window of this many bytes.
+AVG_TASK = 'task6'
+AVG_WINDOW = 32
+AVG_SAMPLE = 0x41
+# The task's input ring is small, so the samples are sent a few at a time.
+AVG_SAMPLES_PER_PACKET = 4
+
+# How many times each repeated step is measured.
+STEP_SAMPLES = 32
+
+# The tasks that are left waiting while the kernel's idle time is measured, and for how long in wall time.
+IDLE_TASKS = (('task5', 0), ('task5_2', 0))
+IDLE_SECONDS = 1
+
+# The tasks from simavr/tasks with their priorities. responder waits on the lock lockhog holds while spinner, which
+# is between them, keeps the CPU busy. NUM_PRIORITIES in config.h is 4.
+RESPONSE_TASKS = (('lockhog', 0), ('spinner', 1), ('responder', 3))
+RESPONSE_BYTE = b'r'
+QUEUE_TASKS = (('consumer', 0), ('producer', 0))
+QUEUE_LINE = b'q\n'
+# consumer prints QUEUE_LINE after this many messages.
+QUEUE_LINE_MESSAGES = 256
+PREEMPT_TASKS = (('busy', 0), (AVG_TASK, 0))
+
+# The wall time to let the kernel catch up between steps. The harness runs the kernel at about real time while it's
+# idle.
+SETTLE_SECONDS = 0.1
+
+
+class SimError(Exception):
+    pass
+
+
+class SimLink:
+    """Looks like the Serial object client.py uses, but talks to the kernel in the harness.
+
+    Also tracks the cycles the bytes crossed the UART at so the steps can be measured.
+    """
+
+    def __init__(self, harness, firmware, timeout=1):
+        self.proc = subprocess.Popen([harness, firmware], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.timeout = timeout
+        self.rx = queue.Queue()
+        self.exit_state = None
+        # The cycle the first byte sent since the last call to measure reached the kernel.
+        self.first_rx_cycle = None
+        # The cycle the last byte read was sent by the kernel.
+        self.last_tx_cycle = 0
+        self.pending_input = 0
+        # Whether the kernel went to sleep or woke up, and the cycle it did at.
+        self.sleep_changes = []
+        self.lock = threading.Lock()
+        threading.Thread(target=self.read_events, daemon=True).start()
+
+    def read_events(self):
+        while True:
+            record = self.proc.stdout.read(event_size)
+            if len(record) < event_size:
+                self.rx.put(None)
+                return
+            (kind, value, cycle) = struct.unpack(event_format, record)
+            if kind == EVENT_TX:
+                self.rx.put((value, cycle))
+            elif kind == EVENT_RX:
+                with self.lock:
+                    self.pending_input -= 1
+                    if self.first_rx_cycle is None:
+                        self.first_rx_cycle = cycle
+            elif kind == EVENT_SLEEP:
+                with self.lock:
+                    self.sleep_changes.append((bool(value), cycle))
+            elif kind == EVENT_EXIT:
+                self.exit_state = value
+
+    def read(self, size=1):
+        out = bytearray()
+        deadline = None if self.timeout is None else time.monotonic() + self.timeout
+        while len(out) < size:
+            try:
+                wait = None if deadline is None else max(0, deadline - time.monotonic())
+                item = self.rx.get(timeout=wait)
+            except queue.Empty:
+                break
+            if item is None:
+                raise SimError(f'The simulation stopped with state {self.exit_state}.')
+            out.append(item[0])
+            self.last_tx_cycle = item[1]
+        return bytes(out)
+
+    def read_all(self):
+        timeout = self.timeout
+        self.timeout = 0
+        out = self.read(self.rx.qsize())
+        self.timeout = timeout
+        return out
+
+    def write(self, data):
+        with self.lock:
+            self.pending_input += len(data)
+        self.proc.stdin.write(data)
+        self.proc.stdin.flush()
+
+    def settle(self):
+        """Wait until the kernel has taken all the input and had time to act on it."""
+        while self.pending_input > 0:
+            if self.proc.poll() is not None:
+                raise SimError('The simulation stopped.')
+            time.sleep(0.01)
+        time.sleep(SETTLE_SECONDS)
+
+    def measure(self, func):
+        """Returns what func returns and the cycles from its first byte reaching the kernel to the last byte read."""
+        with self.lock:
+            self.first_rx_cycle = None
+        result = func()
+        if self.first_rx_cycle is None:
+            raise SimError('Nothing was sent to the kernel.')
+        return result, self.last_tx_cycle - self.first_rx_cycle
+
+    def awake_cycles(self, start, end):
+        """Returns how many of the cycles from start to end the kernel wasn't sleeping for."""
+        with self.lock:
+            changes = list(self.sleep_changes)
+        awake = 0
+        asleep = False
+        last = start
+        for (now_asleep, cycle) in changes:
+            if cycle > end:
+                break
+            if cycle > start:
+                if not asleep:
+                    awake += cycle - last
+                last = cycle
+            asleep = now_asleep
+        if not asleep:
+            awake += end - last
+        return awake
+
+    def close(self):
+        self.proc.stdin.close()
+        self.proc.terminate()
+        self.proc.wait()
+
+
+def read_output(sim, expected):
+    """Read the task output until expected, ignoring anything before it."""
+    data = bytearray()
+    while not data.endswith(expected):
+        c = sim.read(1)
+        if not c:
+            raise SimError(f'Timed out waiting for {expected!r}. Got {bytes(data)!r}.')
+        data += c
+    return bytes(data)
+
+
+def find_task(task_state, name):
+    for task in task_state['tasks']:
+        if task['size'] > 0 and task['name'] == name:
+            return task['index']
+    return None
+
+
+class Steps:
+    """Measures the steps of the scenarios run on one simulation, and keeps their cycles."""
+
+    def __init__(self, sim, cycles, samples):
+        self.sim = sim
+        self.link = DeviceLink(sim)
+        self.cycles = cycles
+        self.samples = samples
+
+    def step(self, name, func):
+        (result, self.cycles[name]) = self.sim.measure(func)
+        self.sim.settle()
+        return result
+
+    def repeat(self, name, func):
+        """Measure func STEP_SAMPLES times. The median is the step's cycles."""
+        samples = []
+        for _ in range(STEP_SAMPLES):
+            samples.append(self.sim.measure(func)[1])
+            self.sim.settle()
+        self.samples[name] = sorted(samples)
+        self.cycles[name] = statistics.median_low(samples)
+
+    def load_tasks(self, tasks_dir, tasks):
+        """Loads and enables each (name, priority) in tasks. Returns the indexes of the tasks."""
+        indexes = []
+        for (name, priority) in tasks:
+            task_state = get_task_list(self.link)
+            if find_task(task_state, name) is not None:
+                raise SimError(f'{name} is already loaded.')
+            load_task(self.link, os.path.join(tasks_dir, name + '.tsk'), name, task_state, priority, 0, False, False)
+            idx = find_task(get_task_list(self.link), name)
+            if idx is None:
+                raise SimError(f'{name} is missing after loading it.')
+            indexes.append(idx)
+        for idx in indexes:
+            enable_task(self.link, idx, True)
+        self.sim.settle()
+        return indexes
+
+    def delete_tasks(self, indexes):
+        for idx in indexes:
+            del_task(self.link, idx)
+        self.sim.settle()
+        # Drop whatever the tasks printed before they went.
+        self.sim.read_all()
+
+
+def fill_avg_window(sim, idx):
+    """Send task6 a full window of samples. Nothing is printed until the window is full."""
+    for _ in range(0, AVG_WINDOW, AVG_SAMPLES_PER_PACKET):
+        send_packet(sim, idx + 1, bytes([AVG_SAMPLE] * AVG_SAMPLES_PER_PACKET))
+        sim.settle()
+
+
+def avg_echo(sim, idx):
+    """Send task6 a sample and wait for the average it prints."""
+    send_packet(sim, idx + 1, bytes([AVG_SAMPLE]))
+    read_output(sim, f'avg {AVG_SAMPLE:02x}\n'.encode('ascii'))
+
+
+def run_load_scenario(steps, tasks_dir):
+    """Loads task6, measures how long it takes to answer, and deletes it."""
+    (sim, link) = (steps.sim, steps.link)
+    task_state = steps.step('list', lambda: get_task_list(link))
+    if find_task(task_state, AVG_TASK) is not None:
+        raise SimError(f'{AVG_TASK} is loaded on a fresh device.')
+
+    steps.step('load', lambda: load_task(link, os.path.join(tasks_dir, AVG_TASK + '.tsk'), AVG_TASK, task_state, 0,
+                                         0, False, False))
+    task_state = get_task_list(link)
+    idx = find_task(task_state, AVG_TASK)
+    if idx is None:
+        raise SimError(f'{AVG_TASK} is missing after loading it.')
+
+    steps.step('enable', lambda: enable_task(link, idx, True))
+    fill_avg_window(sim, idx)
+    steps.repeat('echo', lambda: avg_echo(sim, idx))
+
+    steps.step('delete', lambda: del_task(link, idx))
+    if find_task(get_task_list(link), AVG_TASK) is not None:
+        raise SimError(f'{AVG_TASK} is still loaded after deleting it.')
+
+
+def run_idle_scenario(steps, tasks_dir):
+    """Measures the cycles per second the kernel is awake while the tasks wait for input or time."""
+    (sim, link) = (steps.sim, steps.link)
+    indexes = steps.load_tasks(tasks_dir, IDLE_TASKS)
+    get_task_list(link)
+    start = sim.last_tx_cycle
+    time.sleep(IDLE_SECONDS)
+    sim.measure(lambda: get_task_list(link))
+    end = sim.first_rx_cycle
+    steps.cycles['idle_awake'] = sim.awake_cycles(start, end) * F_CPU // (end - start)
+    steps.delete_tasks(indexes)
+
+
+def run_response_scenario(steps, tasks_dir):
+    """Measures how long the high priority responder takes to echo a byte while the others run."""
+    sim = steps.sim
+    indexes = steps.load_tasks(tasks_dir, RESPONSE_TASKS)
+    responder = indexes[-1]
+
+    def respond():
+        send_packet(sim, responder + 1, RESPONSE_BYTE)
+        read_output(sim, RESPONSE_BYTE)
+    steps.repeat('response', respond)
+    steps.delete_tasks(indexes)
+
+
+def run_queue_scenario(steps, tasks_dir):
+    """Measures the cycles for QUEUE_LINE_MESSAGES messages to go from producer to consumer."""
+    sim = steps.sim
+    indexes = steps.load_tasks(tasks_dir, QUEUE_TASKS)
+    # The first line includes starting the tasks, so the count starts from it.
+    read_output(sim, QUEUE_LINE)
+    start = sim.last_tx_cycle
+    read_output(sim, QUEUE_LINE)
+    steps.cycles['queue'] = sim.last_tx_cycle - start
+    steps.delete_tasks(indexes)
+
+
+def run_scenarios(sim, tasks_dir, cycles, samples):
+    """Adds the cycles for each step to cycles, and the samples of the repeated steps to samples."""
+    steps = Steps(sim, cycles, samples)
+    run_load_scenario(steps, tasks_dir)
+    run_idle_scenario(steps, tasks_dir)
+    run_response_scenario(steps, tasks_dir)
+    run_queue_scenario(steps, tasks_dir)
+
+
+def run_preempt_scenarios(sim, tasks_dir, cycles, samples):
+    """Checks a PREEMPTIVE kernel answers commands and runs task6 while busy never yields."""
+    steps = Steps(sim, cycles, samples)
+    (busy, avg) = steps.load_tasks(tasks_dir, PREEMPT_TASKS)
+    steps.step('preempt_list', lambda: get_task_list(steps.link))
+    fill_avg_window(sim, avg)
+    steps.repeat('preempt_echo', lambda: avg_echo(sim, avg))
+    steps.delete_tasks([busy, avg])
+
+
+def print_samples(name, samples):
+    """Print a histogram of the samples of a repeated step."""
+    (low, high) = (samples[0], samples[-1])
+    buckets = min(8, high - low + 1)
+    width = (high - low) // buckets + 1
+    counts = [0] * buckets
+    for sample in samples:
+        counts[min(buckets - 1, (sample - low) // width)] += 1
+    print(f'{name}: min {low}, median {statistics.median_low(samples)}, max {high} cycles')
+    for (i, count) in enumerate(counts):
+        print(f'  {low + i * width:10} {"#" * count}')
+
+
+def compare(cycles, baseline, tolerance):
+    """Print the cycles against the baseline. Returns False if any step is slower than the tolerance allows."""
+    ok = True
+    for (name, count) in cycles.items():
+        base = baseline.get(name)
+        if base is None:
+            print(f'{name:14} {count:10} cycles')
+            continue
+        change = (count - base) / base
+        slower = change > tolerance
+        ok = ok and not slower
+        print(f'{name:14} {count:10} cycles {change:+7.1%} vs {base}' + (' SLOWER' if slower else ''))
+    return ok
+
+
+def main():
+    parser = ArgumentParser(description='Run the kernel scenarios under simavr and check their cycle counts.')
+    parser.add_argument('--harness', default='./harness', help='The simavr harness built from harness.c.')
+    parser.add_argument('--firmware', default='../build/basic_scheduler5.elf', help='The kernel ELF.')
+    parser.add_argument('--preemptive-firmware', help='The kernel ELF built with PREEMPTIVE, for the preempt steps.')
+    parser.add_argument('--tasks', default='../build', help='The directory with the task images.')
+    parser.add_argument('--results', help='Where to write the cycles for each step as JSON.')
+    parser.add_argument('--baseline', help='The cycles to compare with, from an earlier --results.')
+    parser.add_argument('--update-baseline', action='store_true', help='Write the results to the baseline.')
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help='How much slower than the baseline a step can be, as a fraction.')
+    args = parser.parse_args()
+
+    # A missing baseline would make every check pass, so it's only written when asked for.
+    if args.baseline and not args.update_baseline and not os.path.exists(args.baseline):
+        print(f'There is no baseline at {args.baseline}. Run with --update-baseline, or make check UPDATE=1, to record '
+              'one.')
+        exit(1)
+
+    cycles = {}
+    samples = {}
+    runs = [(args.firmware, run_scenarios)]
+    if args.preemptive_firmware:
+        runs.append((args.preemptive_firmware, run_preempt_scenarios))
+    for (firmware, run) in runs:
+        sim = SimLink(args.harness, firmware)
+        try:
+            run(sim, args.tasks, cycles, samples)
+        except (SimError, CmdError) as e:
+            print(e)
+            exit(1)
+        finally:
+            sim.close()
+
+    results = {'firmware': args.firmware, 'preemptive_firmware': args.preemptive_firmware, 'cycles': cycles,
+               'samples': samples}
+    if args.results:
+        with open(args.results, 'w') as fd:
+            json.dump(results, fd, indent=2)
+
+    for (name, step_samples) in samples.items():
+        print_samples(name, step_samples)
+    baseline = {}
+    if args.baseline and not args.update_baseline:
+        with open(args.baseline) as fd:
+            baseline = json.load(fd)['cycles']
+    ok = compare(cycles, baseline, args.tolerance)
+    if args.baseline and args.update_baseline:
+        with open(args.baseline, 'w') as fd:
+            json.dump(results, fd, indent=2)
+        print(f'Wrote the baseline to {args.baseline}.')
+    if not ok:
+        exit(1)
+
+
+if __name__ == '__main__':
+    main()
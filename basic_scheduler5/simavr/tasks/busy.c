@@ -0,0 +1,14 @@
+// Runs forever without calling a syscall, so it only gives up the CPU when the kernel preempts it. scenarios.py
+// uses it to check a PREEMPTIVE kernel still answers commands and runs the other tasks.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+TASK_ENTRY
+void task() {
+	volatile uint8_t count = 0;
+	while (1) {
+		count++;
+	}
+}
@@ -0,0 +1,23 @@
+// Receives the messages producer.c sends to queue 0 and prints a line every 256 of them. scenarios.py measures the
+// cycles between the lines.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+#define QUEUE_ID 0
+
+TASK_ENTRY
+void task() {
+	uint8_t msg[QUEUE_MSG_SIZE];
+	uint8_t count = 0;
+	char line[2];
+	line[0] = 'q';
+	line[1] = '\n';
+	while (1) {
+		scheduler.queue_receive(QUEUE_ID, msg);
+		if (++count == 0) {
+			scheduler.usart_write(line, sizeof(line));
+		}
+	}
+}
@@ -0,0 +1,16 @@
+// The low priority task in the response time scenario. It holds the shared lock while it sleeps, so responder.c has
+// to wait for it to be raised to responder's priority and let go.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+TASK_ENTRY
+void task() {
+	while (1) {
+		scheduler.get_lock();
+		scheduler.delay_ms(2);
+		scheduler.release_lock();
+		scheduler.delay_ms(1);
+	}
+}
@@ -0,0 +1,16 @@
+// Sends messages to queue 0 as fast as it can for consumer.c, so scenarios.py can measure the queue throughput.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+#define QUEUE_ID 0
+
+TASK_ENTRY
+void task() {
+	uint8_t msg[QUEUE_MSG_SIZE] = {0};
+	while (1) {
+		msg[0]++;
+		scheduler.queue_send(QUEUE_ID, msg);
+	}
+}
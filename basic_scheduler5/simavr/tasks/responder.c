@@ -0,0 +1,20 @@
+// The high priority task in the response time scenario. It echoes each byte it reads while holding the shared lock
+// that lockhog.c also takes, so scenarios.py can measure how long a byte takes to come back.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+TASK_ENTRY
+void task() {
+	uint8_t data;
+	while (1) {
+		if (scheduler.usart_read(&data, 1)) {
+			scheduler.get_lock();
+			scheduler.usart_write(&data, 1);
+			scheduler.release_lock();
+		} else {
+			scheduler.wait_event(EVENT_USART_RX, 0);
+		}
+	}
+}
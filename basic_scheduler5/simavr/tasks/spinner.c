@@ -0,0 +1,18 @@
+// The middle priority task in the response time scenario. It keeps the CPU busy for a couple of milliseconds at a
+// time, which would hold up lockhog.c and so responder.c if the lock didn't raise lockhog's priority.
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+#define SPIN_MS 2
+
+TASK_ENTRY
+void task() {
+	while (1) {
+		uint32_t until = scheduler.get_time() + SPIN_MS * TICKS_PER_MS;
+		while ((int32_t)(scheduler.get_time() - until) < 0) {
+		}
+		scheduler.delay_ms(1);
+	}
+}
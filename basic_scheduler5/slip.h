@@ -0,0 +1,8 @@
+#pragma once
+
+// Special bytes for SLIP (RFC 1055) framing.
+// Every packet ends with SLIP_END, and SLIP_END and SLIP_ESC in the data are replaced by two byte escapes.
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
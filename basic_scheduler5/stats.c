@@ -0,0 +1,48 @@
+#include "stats.h"
+
+#ifdef TASK_STATS
+
+static struct TaskStats task_stats[MAX_LD_TASKS];
+static uint32_t idle_ticks = 0;
+
+void stats_reset(uint8_t idx) {
+	struct TaskStats* stats = task_stats + idx;
+	stats->run_ticks = 0;
+	stats->dispatches = 0;
+	stats->max_slice_ticks = 0;
+	stats->lock_wait_ticks = 0;
+	stats->missed_deadlines = 0;
+}
+
+void stats_add_run(uint8_t idx, uint32_t ticks) {
+	struct TaskStats* stats = task_stats + idx;
+	stats->run_ticks += ticks;
+	stats->dispatches++;
+	if (ticks > stats->max_slice_ticks) {
+		stats->max_slice_ticks = ticks > 0xFFFF ? 0xFFFF : ticks;
+	}
+}
+
+void stats_add_lock_wait(uint8_t idx, uint32_t ticks) {
+	task_stats[idx].lock_wait_ticks += ticks;
+}
+
+void stats_add_missed_deadline(uint8_t idx) {
+	if (task_stats[idx].missed_deadlines < 0xFFFF) {
+		task_stats[idx].missed_deadlines++;
+	}
+}
+
+void stats_add_idle(uint32_t ticks) {
+	idle_ticks += ticks;
+}
+
+const struct TaskStats* stats_get(uint8_t idx) {
+	return task_stats + idx;
+}
+
+uint32_t stats_get_idle() {
+	return idle_ticks;
+}
+
+#endif
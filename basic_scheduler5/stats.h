@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "config.h"
+
+// Counters of how each task behaves at runtime, read by the host with CMD_STATS.
+// The counters are compiled out unless TASK_STATS is defined in config.h.
+
+// The times are in timer1 ticks. The layout is sent to the host as is, so change STATS_VERSION if it changes.
+struct TaskStats {
+	// The total time the task has run since it was enabled.
+	uint32_t run_ticks;
+	// The number of times the task has been switched to.
+	uint32_t dispatches;
+	// The longest the task has run before switching back to the kernel. Stops at 0xFFFF.
+	uint16_t max_slice_ticks;
+	// The total time the task has spent waiting on locks.
+	uint32_t lock_wait_ticks;
+	// The number of times the task called sleep_until with a time that had already passed.
+	uint16_t missed_deadlines;
+};
+
+#define STATS_VERSION 1
+
+#ifdef TASK_STATS
+
+// Clear the counters for a task. Done when it's enabled.
+void stats_reset(uint8_t idx);
+
+// Count a switch to the task that ran for ticks.
+void stats_add_run(uint8_t idx, uint32_t ticks);
+
+void stats_add_lock_wait(uint8_t idx, uint32_t ticks);
+
+void stats_add_missed_deadline(uint8_t idx);
+
+// Count time the kernel spent sleeping with nothing to run.
+void stats_add_idle(uint32_t ticks);
+
+const struct TaskStats* stats_get(uint8_t idx);
+
+uint32_t stats_get_idle();
+
+#define STATS_RESET(idx) stats_reset(idx)
+#define STATS_ADD_RUN(idx, ticks) stats_add_run(idx, ticks)
+#define STATS_ADD_LOCK_WAIT(idx, ticks) stats_add_lock_wait(idx, ticks)
+#define STATS_ADD_MISSED_DEADLINE(idx) stats_add_missed_deadline(idx)
+#define STATS_ADD_IDLE(ticks) stats_add_idle(ticks)
+
+#else
+
+#define STATS_RESET(idx) ((void)0)
+#define STATS_ADD_RUN(idx, ticks) ((void)0)
+#define STATS_ADD_LOCK_WAIT(idx, ticks) ((void)0)
+#define STATS_ADD_MISSED_DEADLINE(idx) ((void)0)
+#define STATS_ADD_IDLE(ticks) ((void)0)
+
+#endif
@@ -4,24 +4,23 @@
  * Comments assume F_CPU == 16e6 (default Arduino clock)
  */
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
 #include <stdbool.h>
 
-#ifndef F_CPU
-	#define F_CPU 16000000
-#endif
-
-
+#include "hal.h"
 #include "scheduler_funcs.h"
+#include "events.h"
+#include "locks.h"
+#include "queues.h"
+#include "run_queue.h"
 #include "syscalls.h"
 #include "serial.h"
+#include "stats.h"
 
 // We're tracking time based on timer1 which runs at F_CPU / 64.
 // The casting to to avoid overflowing the integer sizes.
 // Much more efficient to do this without floating point eventually.
 //#define MS_TO_TICKS(ms) (F_CPU / (1000.0d * 64.0d / ((double)ms)))
-#define MS_TO_TICKS(ms) (250 * ms)
+#define MS_TO_TICKS(ms) ((uint32_t)TICKS_PER_MS * (ms))
 
 
 // Referenced in assembly code.
@@ -33,49 +32,79 @@ extern  volatile uint8_t* kernel_sp;
 // Used to track which task is active.
 extern uint8_t task_idx;
 
-// Read timer1 counter.
-// This timer overflows every ~4 seconds
-inline uint16_t get_time() {
-	// From datasheet: "Each 16-bit timer has a single 8-bit register for temporary storing of the
-	// high byte of the 16-bit access... For a 16-bit read, the low byte must be read before the high byte." 
-	uint16_t ret = TCNT1L;
-	return ret | (TCNT1H << 8);
+// Defined in dispatch.c
+extern struct Task tasks[MAX_LD_TASKS];
+
+// The upper 16 bits of the time. Incremented each time timer1 overflows (every ~262 ms).
+static volatile uint16_t timer1_overflows = 0;
+
+HAL_ISR(TIMER1_OVF_vect)
+{
+	timer1_overflows++;
+}
+
+// Read timer1 counter extended to 32 bits by the overflow count.
+// This overflows every ~4.7 hours.
+uint32_t get_time() {
+	uint16_t low;
+	uint16_t high;
+	HAL_ATOMIC {
+		low = hal_timer1_read();
+		high = timer1_overflows;
+		// The timer may have overflowed after interrupts were disabled, in which case the ISR hasn't counted
+		// it yet. If the low word is small, it was read after the overflow.
+		if (hal_timer1_overflow_pending() && low < 0x8000) {
+			high++;
+		}
+	}
+	return ((uint32_t)high << 16) | low;
 }
 
-// Ticks are 64us based on timer1 settings
-// To keep things simple, I'm going to assume the delay times are much less than 2^15 as a way to detect overflows.
+// Ticks are 4us based on timer1 settings
 void delay_ms(uint16_t ms) {
-	uint16_t ticks = MS_TO_TICKS(ms);
+	delay_ticks(MS_TO_TICKS(ms));
+}
+
+void delay_ticks(uint32_t ticks) {
 	current_task->next_run = get_time() + ticks;
 	suspend_task();
 }
 
-// Check if a pointer shared between tasks has been set, and if so wait until it's cleared.
-// The value of the lock is LOCK_FREE if cleared, or the task_idx of the task holding the lock.
-// This doesn't need a critical section since there's no preemption.
-#define LOCK_FREE 0xFF
-uint8_t shared_lock = LOCK_FREE;
-void get_lock() {
-	while(shared_lock != LOCK_FREE && shared_lock != task_idx) {
-		// Update the next wake up time so it doesn't overflow.
-		current_task->next_run = get_time();
-		suspend_task();
+void sleep_until(uint32_t deadline) {
+	// A periodic task that passes a deadline that's already gone has overrun its period.
+	if (is_time_past(deadline)) {
+		STATS_ADD_MISSED_DEADLINE(task_idx);
 	}
-	shared_lock = task_idx;
+	current_task->next_run = deadline;
+	suspend_task();
+}
+
+// The original single lock is lock 0 in the lock table.
+#define SHARED_LOCK 0
+void get_lock() {
+	mutex_lock(SHARED_LOCK);
 }
 
 void release_lock() {
-	shared_lock = LOCK_FREE;
+	force_unlock(SHARED_LOCK);
 }
 
 bool is_lock_available() {
-	return shared_lock == LOCK_FREE || shared_lock == task_idx;
+	return is_mutex_available(SHARED_LOCK);
 }
 
 uint8_t usart_read(void* data, uint8_t len) {
 	return USART_Read(task_idx + 1, data, len);
 }
 
+uint8_t usart_peek(const uint8_t** data) {
+	return USART_Rx_Peek(task_idx + 1, data);
+}
+
+void usart_commit(uint8_t len) {
+	USART_Rx_Commit(task_idx + 1, len);
+}
+
 const char* get_task_name(uint8_t* size) {
 	if (size != 0) {
 		*size = 0;
@@ -88,10 +117,16 @@ const char* get_task_name(uint8_t* size) {
 	return (const char*)current_task->name;
 }
 
+void set_task_priority(uint8_t idx, uint8_t priority) {
+	tasks[idx].base_priority = priority;
+	// Don't drop a priority the task inherited by holding a lock.
+	update_task_priority(idx);
+}
+
 void cleanup_task(uint8_t idx) {
-	if (shared_lock == idx) {
-		release_lock();
-	}
+	release_task_locks(idx);
+	remove_queue_waiter(idx);
+	clear_task_events(idx);
 }
 
 // Initialize the shared function pointers.
@@ -103,26 +138,27 @@ void setup_scheduler_funcs() {
 	scheduler.usart_read = usart_read;
 	scheduler.usart_write = USART_Send;
 	scheduler.usart_write_free = USART_Tx_Free_Buffer;
+	scheduler.usart_peek = usart_peek;
+	scheduler.usart_commit = usart_commit;
 	scheduler.get_task_name = get_task_name;
+	scheduler.get_time = get_time;
+	scheduler.delay_ticks = delay_ticks;
+	scheduler.sleep_until = sleep_until;
+	scheduler.mutex_lock = mutex_lock;
+	scheduler.mutex_try_lock = mutex_try_lock;
+	scheduler.mutex_unlock = mutex_unlock;
+	scheduler.queue_try_send = queue_try_send;
+	scheduler.queue_send = queue_send;
+	scheduler.queue_try_receive = queue_try_receive;
+	scheduler.queue_receive = queue_receive;
+	scheduler.wait_event = wait_event;
+	scheduler.post_event = post_event;
+	reset_locks();
+	reset_queues();
+	reset_events();
 }
 
-// This assumes that the tasks are running for less than 125 ms, and delaying for less than 125 ms.
-// This time scale could be increased either by slowing down timer1 (and losing precision) or by using a timer interrupt to make the effective timer size 32 bit.
-bool is_time_past(uint16_t target_time) {
-	uint16_t current_time = get_time();
-	const int32_t HALF_TIMER = 0x8000;
-	
-	int32_t diff = ((int32_t)target_time) - ((int32_t)current_time);
-	
-	// If target_time rolled over, but current_time hasn't
-	if (diff < -HALF_TIMER) {
-		return false;	
-	}
-	// If current_time rolled over, but target_time hasn't
-	else if(diff > HALF_TIMER) {
-		return true;
-	}
-	else {
-		return diff < 0;
-	}	
+// This assumes that target_time is within ~2.4 hours (half the 32 bit timer range) of the current time.
+bool is_time_past(uint32_t target_time) {
+	return (int32_t)(target_time - get_time()) < 0;
 }
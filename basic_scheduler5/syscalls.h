@@ -2,12 +2,35 @@
 
 #include <stdbool.h>
 
-// These functions are declared in helpers.s . They back up the registers and switch stacks
-// between the current task and the kernel.
+#include "config.h"
+
+// These functions are declared in helpers.s (host/hal_host.c for the host build). They back up the registers and
+// switch stacks between the current task and the kernel.
+// The kernel should use START_TASK rather than calling start_task directly.
 extern void start_task(void);
 extern void suspend_task(void);
 
+#if defined(LEAN_KERNEL_SWITCH) && !defined(HAL_HOST)
+// start_task doesn't save r2-r17 for the kernel in this mode, so tell the compiler they're clobbered along with the
+// registers any call clobbers. It then only saves the ones that are live in the main loop, which is usually few or
+// none. The task side still saves all of the call-saved registers since the task is suspended in the middle of
+// its code.
+#define START_TASK() __asm__ __volatile__ ("call start_task" ::: \
+	"r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15", "r16", "r17", \
+	"r18", "r19", "r20", "r21", "r22", "r23", "r24", "r25", "r26", "r27", "r30", "r31", "memory")
+#else
+#define START_TASK() start_task()
+#endif
+
 typedef void (*task_sig)(uint16_t);
+
+// Why the kernel stopped a task.
+enum TaskFault {
+	TASK_FAULT_NONE = 0,
+	// The task wrote past the bottom of its stack.
+	TASK_FAULT_STACK = 1
+};
+
 // This is what's needed to specify a task.
 struct Task {
 	// All the state is on the stack with it's end at this pointer.
@@ -15,26 +38,43 @@ struct Task {
 	// This is used to point to the function for the task to start at.
 	uint16_t task_offset;
 	// This is used to schedule when the task will run next.
-	uint16_t next_run;
+	uint32_t next_run;
 	char name[16];
 	uint16_t size;
 	bool enabled; 
+	// The priority used for scheduling. This can be raised above base_priority while the task holds a lock
+	// another task is waiting on.
+	uint8_t priority;
+	// The priority set by the loader.
+	uint8_t base_priority;
+	// The lowest address of the task's stack while it's enabled.
+	uint8_t* stack_start;
+	uint8_t stack_size;
+	// The most of the stack the task has used since it was enabled. Only updated when the tasks are listed.
+	uint8_t stack_used;
+	// The TaskFault the task was last stopped for. Cleared when it's enabled.
+	uint8_t fault;
 };
 
-// Read timer1 counter.
-// This timer overflows every ~4 seconds
-uint16_t get_time();
+// Read timer1 counter extended to 32 bits by counting the timer overflows.
+// This overflows every ~4.7 hours.
+uint32_t get_time();
 
-// Ticks are 64us based on timer1 settings
-// To keep things simple, I'm going to assume the delay times are much less than 2^15 as a way to detect overflows.
+// Ticks are 4us based on timer1 settings
 void delay_ms(uint16_t ms);
 
-// Check if a pointer shared between tasks has been set, and if so wait until it's cleared.
-// The value of the lock is LOCK_FREE if cleared, or the task_idx of the task holding the lock.
-// This doesn't need a critical section since there's no preemption.
+// Suspend the current task for the given number of ticks.
+void delay_ticks(uint32_t ticks);
+
+// Suspend the current task until get_time() reaches the deadline. Periodic tasks can add their period to
+// the previous deadline to avoid drifting.
+void sleep_until(uint32_t deadline);
+
+// Take lock 0 in the lock table, blocking until it's free.
+// While waiting, the task holding the lock inherits the waiting task's priority if it's higher.
 void get_lock();
 
-// Release the lock (regardless of what task is holding it).
+// Release lock 0 (regardless of what task is holding it) and drop any inherited priority.
 void release_lock();
 
 // Returns false if `get_lock()` would block.
@@ -43,15 +83,22 @@ bool is_lock_available();
 // Read the UART buffer for the currently active task.
 uint8_t usart_read(void* data, uint8_t len);
 
-// Initialize the shared function pointers.
+// Zero copy reads of the UART buffer for the currently active task. See USART_Rx_Peek and USART_Rx_Commit.
+uint8_t usart_peek(const uint8_t** data);
+void usart_commit(uint8_t len);
+
+// Initialize the shared function pointers, the lock table, the message queues, and the event flags.
 void setup_scheduler_funcs();
 
-// This assumes that the tasks are running for less than 125 ms, and delaying for less than 125 ms.
-// This time scale could be increased either by slowing down timer1 (and losing precision) or by using a timer interrupt to make the effective timer size 32 bit.
-bool is_time_past(uint16_t target_time);
+// This assumes that target_time is within ~2.4 hours (half the 32 bit timer range) of the current time.
+bool is_time_past(uint32_t target_time);
 
 // Return the pointer to the current task's name string.
 const char* get_task_name(uint8_t* size);
 
-// Have a task release any resources (like locks) it might be holding.
+// Change the base priority of a task.
+void set_task_priority(uint8_t idx, uint8_t priority);
+
+// Have a task release any resources (like locks) it might be holding, and stop waiting on any locks, queues,
+// or events.
 void cleanup_task(uint8_t idx);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dispatch.h"
+
+// Each loaded task takes whole flash pages from its offset to the end of its last page. This is in a header so the
+// host tests can check it with their own page size, since SPM_PAGESIZE is AVR only.
+
+// Returns true if the pages from offset to offset + size don't overlap the pages of any loaded task other than skip.
+static inline bool task_range_is_free(uint8_t skip, uint16_t offset, uint16_t size, uint16_t page_size) {
+	uint16_t end = offset + (size + page_size - 1) / page_size * page_size;
+	for (uint8_t i = 0; i < MAX_LD_TASKS; i++) {
+		if (i == skip || tasks[i].size == 0) {
+			continue;
+		}
+		uint16_t task_end = tasks[i].task_offset + (tasks[i].size + page_size - 1) / page_size * page_size;
+		if (offset < task_end && tasks[i].task_offset < end) {
+			return false;
+		}
+	}
+	return true;
+}
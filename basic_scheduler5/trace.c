@@ -0,0 +1,58 @@
+#include "hal.h"
+#include "trace.h"
+
+#ifdef TRACE
+
+static struct TraceRecord trace_ring[TRACE_DEPTH];
+// The index the next record is written to.
+static uint8_t trace_head = 0;
+static uint8_t trace_count = 0;
+static uint8_t trace_dropped = 0;
+static bool trace_paused = false;
+
+void trace_record(uint8_t type, uint8_t arg) {
+	HAL_ATOMIC {
+		if (trace_paused) {
+			return;
+		}
+		struct TraceRecord* record = trace_ring + trace_head;
+		record->type = type;
+		record->arg = arg;
+		record->time = hal_timer1_read();
+		trace_head = (trace_head + 1) & (TRACE_DEPTH - 1);
+		if (trace_count < TRACE_DEPTH) {
+			trace_count++;
+		} else if (trace_dropped < 0xFF) {
+			trace_dropped++;
+		}
+	}
+}
+
+uint8_t trace_drain_begin(uint8_t* dropped) {
+	uint8_t count;
+	HAL_ATOMIC {
+		trace_paused = true;
+		count = trace_count;
+		*dropped = trace_dropped;
+		trace_dropped = 0;
+	}
+	return count;
+}
+
+bool trace_pop(struct TraceRecord* record) {
+	bool found = false;
+	HAL_ATOMIC {
+		if (trace_count > 0) {
+			*record = trace_ring[(uint8_t)(trace_head - trace_count) & (TRACE_DEPTH - 1)];
+			trace_count--;
+			found = true;
+		}
+	}
+	return found;
+}
+
+void trace_drain_end() {
+	trace_paused = false;
+}
+
+#endif
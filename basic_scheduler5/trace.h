@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "config.h"
+
+// A ring of timestamped records of what the kernel is doing, drained by the host with CMD_TRACE.
+// When the ring is full the oldest records are overwritten and counted as dropped.
+// Recording is compiled out unless TRACE is defined in config.h.
+
+enum TraceType {
+	// arg is the task index.
+	TRACE_SWITCH_IN = 1,
+	// The task suspended itself. arg is the task index.
+	TRACE_SWITCH_OUT = 2,
+	// The task was switched out by the time slice timer. arg is the task index.
+	TRACE_PREEMPT = 3,
+	// The task was made ready to run. arg is the task index.
+	TRACE_WAKE = 4,
+	// For the lock events, arg is the task index in the high nibble and the lock in the low nibble.
+	TRACE_LOCK_ACQUIRE = 5,
+	TRACE_LOCK_WAIT = 6,
+	TRACE_LOCK_RELEASE = 7,
+	// A byte was received. arg is the channel of the packet being received, 0xFE if it's the start of a packet, or
+	// 0xFF if it's not in a packet.
+	TRACE_UART_RX = 8,
+	// The transmit buffer was emptied.
+	TRACE_UART_TX_DONE = 9
+};
+
+struct TraceRecord {
+	uint8_t type;
+	uint8_t arg;
+	// The low 16 bits of get_time. The host works out the rest from the time sent with the records.
+	uint16_t time;
+};
+
+#ifdef TRACE
+
+#if TRACE_DEPTH & (TRACE_DEPTH - 1)
+	#error "TRACE_DEPTH must be a power of 2."
+#endif
+
+// Add a record to the ring. This is safe to call from interrupts.
+void trace_record(uint8_t type, uint8_t arg);
+
+#define TRACE_EVENT(type, arg) trace_record(type, arg)
+#define TRACE_LOCK_ARG(idx, lock) (((idx) << 4) | (lock))
+
+// Pause recording and get the number of records to drain and the number dropped since the last drain.
+// Sending the records makes more UART records, so nothing is recorded until trace_drain_end.
+uint8_t trace_drain_begin(uint8_t* dropped);
+
+// Take the oldest record out of the ring. Returns false if it's empty.
+bool trace_pop(struct TraceRecord* record);
+
+// Start recording again.
+void trace_drain_end();
+
+#else
+
+#define TRACE_EVENT(type, arg) ((void)0)
+
+#endif
@@ -15,6 +15,10 @@ const char LOCKING_STR[] PROGMEM = "locking\n";
 const char LOCKED_STR[] PROGMEM = "locked\n";
 const char GOT_STR[] PROGMEM = "Got ";
 
+// The most that's read at once. The kernel only holds RX_BUFFER_LEN - 1 bytes for the task, and buffer only has space
+// for 9 between "Got " and the newline. Longer input has to be sent in pieces, which are echoed one at a time.
+#define READ_LEN (RX_BUFFER_LEN - 1 < 9 ? RX_BUFFER_LEN - 1 : 9)
+
 // Helper macro to output task name followed by string.
 #define SEND_P_STR_AND_NAME(str) \
     scheduler.usart_write(name, name_len); \
@@ -56,7 +60,7 @@ void task()  {
 			// Only try to process data if TX buffer has free space.
 			if (scheduler.usart_write_free() > 16) {
 				// If we received serial data echo it and release the lock.
-				uint8_t len = scheduler.usart_read(buffer+6, 9);
+				uint8_t len = scheduler.usart_read(buffer+6, READ_LEN);
 				if (len && buffer[6] > 31) {
 					memcpy_P(buffer+2, GOT_STR, 4); 
 					buffer[6 + len] = '\n';
@@ -66,7 +70,8 @@ void task()  {
 					break;
 				}
 			}
-			scheduler.delay_ms(100);
+			// Wake up as soon as data arrives, or after 100ms to check the TX buffer again.
+			scheduler.wait_event(EVENT_USART_RX, 100 * TICKS_PER_MS);
 		}
 		scheduler.delay_ms(100);
 	}
@@ -26,6 +26,7 @@ void task()  {
 				PORTB ^= 1 << 5;
 			}
 		}
-		scheduler.delay_ms(100);
+		// Sleep until more data arrives.
+		scheduler.wait_event(EVENT_USART_RX, 0);
 	}
 }
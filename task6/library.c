@@ -0,0 +1,56 @@
+/*
+ * task6.c
+ *
+ * Keeps a moving average of the bytes read from the UART. The window is in .bss and the count of samples until it's
+ * full is in .data, so this checks the kernel clears .bss and copies the initial values of .data. The bytes are read
+ * in place with usart_peek and usart_commit.
+ */ 
+
+#include <avr/io.h>
+
+#include "scheduler_funcs.h"
+
+#define WINDOW_SIZE 32
+
+static uint8_t window[WINDOW_SIZE];
+static uint8_t window_pos;
+static uint16_t sum;
+// The average isn't printed until the window is full.
+static uint8_t samples_needed = WINDOW_SIZE;
+static const char prefix[] = "avg ";
+
+static void write_hex(uint8_t val) {
+	static const char digits[] = "0123456789abcdef";
+	char out[3] = {digits[val >> 4], digits[val & 0x0F], '\n'};
+	scheduler.usart_write(out, sizeof(out));
+}
+
+static void add_sample(uint8_t val) {
+	sum += val;
+	sum -= window[window_pos];
+	window[window_pos] = val;
+	window_pos = (window_pos + 1) % WINDOW_SIZE;
+	if (samples_needed) {
+		samples_needed--;
+		return;
+	}
+	scheduler.usart_write(prefix, sizeof(prefix) - 1);
+	write_hex(sum / WINDOW_SIZE);
+}
+
+TASK_ENTRY
+void task()  {
+	const uint8_t* data;
+	uint8_t len;
+	while (1) {
+		// Take the samples straight out of the kernel's receive buffer.
+		while ((len = scheduler.usart_peek(&data))) {
+			for (uint8_t i = 0; i < len; i++) {
+				add_sample(data[i]);
+			}
+			scheduler.usart_commit(len);
+		}
+		// Sleep until more data arrives.
+		scheduler.wait_event(EVENT_USART_RX, 0);
+	}
+}